@@ -4,25 +4,287 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <spawn.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
 #include <janet.h>
 
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define PSPAWN_HAVE_PIDFD
+#endif
+
+#if defined(__linux__) && defined(SYS_clone3)
+#define PSPAWN_HAVE_CLONE3
+#endif
+
+/* The forkserver needs CLONE_PARENT so the children it starts are ours to wait for. */
+#ifdef __linux__
+#define PSPAWN_HAVE_FORKSERVER
+#endif
+
+/* macOS has no fexecve. */
+#ifndef __APPLE__
+#define PSPAWN_HAVE_FEXECVE
+#endif
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+#define PSPAWN_HAVE_COPY_FILE_RANGE
+#endif
+
+#if defined(__APPLE__) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)))
+#define PSPAWN_HAVE_ADDCHDIR
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define PSPAWN_HAVE_ADDCLOSEFROM
+#endif
+
 typedef struct {
     pid_t pid;
     int close_signal;
     int exited;
     int wstatus;
+    /* Resource usage of the child, valid once it exited. */
+    struct rusage rusage;
+    /* The process group the child was put in, 0 if it was left in ours. */
+    pid_t pgid;
+    /* Close and gc signal the whole process group. */
+    int close_group;
+    /* Seconds close waits before sending kill_signal, negative waits forever. */
+    double close_timeout;
+    int kill_signal;
+    /* Report death by a signal as 128+sig like a shell, instead of 129. */
+    int shell_exit_codes;
+    /* The last stop or continue seen by wait-state, 0 if none, and its reaper count. */
+    int state_wstatus;
+    unsigned state_seq;
+    /* Given up by release or :detached, the child is reaped in the background. */
+    int released;
+    /* The reaper table registration of the child, 0 if it has none. */
+    unsigned reap_gen;
+    /* Monotonic timestamps in ns, 0 when not recorded. */
+    struct {
+        uint64_t start;   /* The spawn call was made. */
+        uint64_t spawn;   /* The spawn syscall was made, after marshalling. */
+        uint64_t spawned; /* The spawn syscall returned. */
+        uint64_t exited;  /* The exit was observed by a wait. */
+    } times;
+    /* Set once the handle has been marshalled to another thread. */
+    struct ProcShared *shared;
 } Process;
 
+/*
+   Exit state shared by the handles of a process that was marshalled to
+   other threads. Whichever handle sees the exit first records it here, so
+   the others don't wait for a pid that was already reaped.
+*/
+typedef struct ProcShared {
+    pthread_mutex_t lock;
+    int refs;
+    int exited;
+    int wstatus;
+    struct rusage rusage;
+    /* The exit has been counted in stats by one of the handles. */
+    int stats_counted;
+} ProcShared;
+
+static void process_init(Process *p, int close_signal) {
+    p->close_signal = close_signal;
+    p->pid = -1;
+    p->exited = 1;
+    p->wstatus = 0;
+    p->pgid = 0;
+    p->close_group = 0;
+    p->close_timeout = -1;
+    p->kill_signal = SIGKILL;
+    p->shell_exit_codes = 0;
+    p->state_wstatus = 0;
+    p->state_seq = 0;
+    p->released = 0;
+    p->reap_gen = 0;
+    memset(&p->times, 0, sizeof(p->times));
+    p->shared = NULL;
+}
+
+/*
+   Optional instrumentation, off until enabled with posix-spawn/instrument.
+   Counters cover processes spawned while it was enabled.
+*/
+static volatile int stats_enabled = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t spawns;
+    uint64_t failures;
+    uint64_t marshal_ns;
+    uint64_t spawn_ns;
+    uint64_t spawn_ns_max;
+    int64_t live;
+} stats;
+
+/* Returns 0 when instrumentation is disabled. */
+static uint64_t stats_now(void) {
+    if (!stats_enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_spawned(Process *p, int err) {
+    pthread_mutex_lock(&stats_lock);
+    if (err) {
+        stats.failures++;
+    } else {
+        uint64_t ns = p->times.spawned - p->times.spawn;
+        stats.spawns++;
+        stats.live++;
+        stats.marshal_ns += p->times.spawn - p->times.start;
+        stats.spawn_ns += ns;
+        if (ns > stats.spawn_ns_max)
+            stats.spawn_ns_max = ns;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_exited(Process *p) {
+    if (!p->times.spawned)
+        return;
+    p->times.exited = stats_now();
+    /* Count the exit once for all handles of the process. */
+    if (p->shared) {
+        pthread_mutex_lock(&p->shared->lock);
+        int counted = p->shared->stats_counted;
+        p->shared->stats_counted = 1;
+        pthread_mutex_unlock(&p->shared->lock);
+        if (counted)
+            return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    stats.live--;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+   Mark p exited once a wait saw it. The group is not signalled after
+   this, once it is empty its id can be reused by an unrelated group.
+*/
+static void process_set_exited(Process *p) {
+    p->exited = 1;
+    p->close_group = 0;
+    stats_exited(p);
+}
+
+/* Record the exit p saw in its shared state, if it has one. */
+static void process_shared_put(Process *p) {
+    ProcShared *sh = p->shared;
+    if (!sh)
+        return;
+    pthread_mutex_lock(&sh->lock);
+    if (!sh->exited) {
+        sh->exited = 1;
+        sh->wstatus = p->wstatus;
+        sh->rusage = p->rusage;
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Copy an exit seen by another handle of p, returns 1 if there was one. */
+static int process_shared_get(Process *p) {
+    ProcShared *sh = p->shared;
+    int exited = 0;
+    if (!sh)
+        return 0;
+    pthread_mutex_lock(&sh->lock);
+    if (sh->exited) {
+        p->wstatus = sh->wstatus;
+        p->rusage = sh->rusage;
+        exited = 1;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return exited;
+}
+
+/*
+   Wait for a process with handles in other threads, without the reaper.
+   The reap is done under the shared lock, so once it is held a missing
+   child means another handle already recorded the exit.
+   Returns 1 if the process exited, 0 if it is still running,
+   or -1 and sets errno on error.
+*/
+static int process_shared_wait(Process *p, int flags) {
+    ProcShared *sh = p->shared;
+    int found = 0;
+    pid_t rc;
+
+    if (!(flags & WNOHANG)) {
+        /* Block until the child is a zombie without reaping it. */
+        siginfo_t info;
+        int err;
+        do {
+            err = waitid(P_PID, p->pid, &info, WEXITED | WNOWAIT);
+        } while (err < 0 && errno == EINTR);
+        if (err < 0 && errno != ECHILD)
+            return -1;
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    if (sh->exited) {
+        p->wstatus = sh->wstatus;
+        p->rusage = sh->rusage;
+        found = 1;
+    } else {
+        do {
+            rc = wait4(p->pid, &p->wstatus, WNOHANG, &p->rusage);
+        } while (rc < 0 && errno == EINTR);
+        if (rc > 0) {
+            sh->exited = 1;
+            sh->wstatus = p->wstatus;
+            sh->rusage = p->rusage;
+            found = 1;
+        } else if (rc < 0) {
+            found = -1;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    return found;
+}
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double secs) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)secs;
+    ts.tv_nsec = (long)((secs - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
 /*
    Get a process exit code, the process must have had process_wait called.
    Returns -1 and sets errno on error, otherwise returns the exit code.
@@ -38,8 +300,7 @@ static int process_exit_code(Process *p) {
     if (WIFEXITED(p->wstatus)) {
         exit_code = WEXITSTATUS(p->wstatus);
     } else if (WIFSIGNALED(p->wstatus)) {
-        // Should this be a function of the signal?
-        exit_code = 129;
+        exit_code = p->shell_exit_codes ? 128 + WTERMSIG(p->wstatus) : 129;
     } else {
         /* This should be unreachable afaik */
         errno = EINVAL;
@@ -49,393 +310,4707 @@ static int process_exit_code(Process *p) {
     return exit_code;
 }
 
-/*
-   Returns -1 and sets errno on error, otherwise returns the process exit code.
-*/
-
-static int process_wait(Process *p, int *exit, int flags) {
-    int _exit = 0;
-    if (!exit)
-        exit = &_exit;
-
-    if (p->pid == -1) {
-        errno = EINVAL;
+/* Create a pipe with FD_CLOEXEC set on both ends, returns -1 and sets errno on error. */
+static int cloexec_pipe(int fds[2]) {
+#ifdef __APPLE__
+    if (pipe(fds) < 0)
         return -1;
-    }
-
-    if (p->exited) {
-        *exit = process_exit_code(p);
-        return 0;
-    }
-
-    int err;
 
-    do {
-        err = waitpid(p->pid, &p->wstatus, flags);
-    } while (err < 0 && errno == EINTR);
-
-    if (err < 0)
+    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+        int saved_errno = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved_errno;
         return -1;
-
-    if ((flags & WNOHANG && err == 0)) {
-        *exit = -1;
-        return 0;
     }
 
-    p->exited = 1;
-    *exit = process_exit_code(p);
     return 0;
+#else
+    return pipe2(fds, O_CLOEXEC);
+#endif
 }
 
-static int process_signal(Process *p, int sig) {
-    int err;
-
-    if (p->exited || p->pid == -1)
-        return 0;
+/*
+   A shared SIGCHLD self pipe, used for async waits without a pidfd or the
+   reaper. The handler can't take locks, so a thread drains the pipe and
+   writes to a pipe of each waiting fiber, every waiter then sees each
+   SIGCHLD and rechecks its own child.
+*/
+typedef struct SigchldWaiter {
+    struct SigchldWaiter *prev;
+    struct SigchldWaiter *next;
+    int fd; /* The write end, the fiber listens on the read end. */
+} SigchldWaiter;
 
-    do {
-        err = kill(p->pid, sig);
-    } while (err < 0 && errno == EINTR);
+static pthread_mutex_t sigchld_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sigchld_pipe[2] = {-1, -1};
+static struct sigaction sigchld_prev;
+static SigchldWaiter *sigchld_waiters = NULL;
 
-    if (err < 0)
-        return -1;
+static void sigchld_handler(int sig, siginfo_t *info, void *ctx) {
+    int saved_errno = errno;
+    ssize_t rc = write(sigchld_pipe[1], "", 1);
+    (void)rc; /* A full pipe already has a wakeup pending. */
+    errno = saved_errno;
 
-    return 0;
+    if (sigchld_prev.sa_flags & SA_SIGINFO) {
+        if (sigchld_prev.sa_sigaction)
+            sigchld_prev.sa_sigaction(sig, info, ctx);
+    } else if (sigchld_prev.sa_handler != SIG_DFL && sigchld_prev.sa_handler != SIG_IGN) {
+        sigchld_prev.sa_handler(sig);
+    }
 }
 
-static int process_gc(void *ptr, size_t s) {
-    (void)s;
-    int err;
+/* Create a CLOEXEC pipe with both ends non-blocking, returns -1 and sets errno on error. */
+static int nonblock_pipe(int fds[2]) {
+    if (cloexec_pipe(fds) < 0)
+        return -1;
 
-    Process *p = (Process *)ptr;
-    if (!p->exited && p->pid != -1) {
-        do {
-            err = kill(p->pid, p->close_signal);
-        } while (err < 0 && errno == EINTR);
-        if (process_wait(p, NULL, 0) < 0) {
-            /* Not much we can do here. */
-            p->exited = 1;
-        }
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        int saved_errno = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved_errno;
+        return -1;
     }
+
     return 0;
 }
 
+static void *sigchld_main(void *arg) {
+    (void)arg;
+    struct pollfd pfd = {sigchld_pipe[0], POLLIN, 0};
 
-static Janet pspawn_close(int32_t argc, Janet *argv);
-static Janet pspawn_wait(int32_t argc, Janet *argv);
-static Janet pspawn_signal(int32_t argc, Janet *argv);
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0)
+            continue;
 
-static JanetMethod process_methods[] = {
-    {"close", pspawn_close}, /* So processes can be used with 'with' */
-    {"wait",  pspawn_wait},
-    {"signal", pspawn_signal},
-    {NULL, NULL}
-};
+        char buf[64];
+        while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
 
-static int process_get(void *ptr, Janet key, Janet *out) {
-    Process *p = (Process *)ptr;
+        pthread_mutex_lock(&sigchld_lock);
+        for (SigchldWaiter *w = sigchld_waiters; w; w = w->next) {
+            ssize_t rc = write(w->fd, "", 1);
+            (void)rc; /* A full pipe already has a wakeup pending. */
+        }
+        pthread_mutex_unlock(&sigchld_lock);
+    }
 
-    if (!janet_checktype(key, JANET_KEYWORD))
-        return 0;
+    return NULL;
+}
 
-    if (janet_keyeq(key, "pid")) {
-        *out = (p->pid == -1) ? janet_wrap_nil() : janet_wrap_integer(p->pid);
-        return 1;
-    }
+/* Returns -1 and sets errno on error. */
+static int sigchld_pipe_init(void) {
+    int rc = 0;
 
-    if (janet_keyeq(key, "exit-code")) {
-        int exit_code;
+    pthread_mutex_lock(&sigchld_lock);
 
-        if (process_wait(p, &exit_code, WNOHANG) != 0)
-            janet_panicf("error checking exit status: %s", strerror(errno));
+    if (sigchld_pipe[0] != -1)
+        goto done;
 
-        *out = (exit_code == -1) ? janet_wrap_nil() : janet_wrap_integer(exit_code);
-        return 1;
+    int fds[2];
+    if (nonblock_pipe(fds) < 0) {
+        rc = -1;
+        goto done;
     }
 
-    return janet_getmethod(janet_unwrap_keyword(key), process_methods, out);
-}
-
-static const JanetAbstractType process_type = {
-    "posix-spawn/process", process_gc, NULL, process_get, JANET_ATEND_GET
-};
+    sigchld_pipe[0] = fds[0];
+    sigchld_pipe[1] = fds[1];
 
-static const char *arg_string(Janet v) {
-    switch (janet_type(v)) {
-    case JANET_STRING:
-        return (const char *)janet_unwrap_string(v);
-    case JANET_SYMBOL:
-        return (const char *)janet_unwrap_symbol(v);
-    default:
-        return NULL;
-    }
-}
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigchld_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
 
-static Janet primitive_pspawn(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 8);
+    if (sigaction(SIGCHLD, &sa, &sigchld_prev) < 0)
+        goto fail;
 
-    int want_errorf;
-    char *error_msg;
-    Janet error_ctx;
-    const char *pcmd;
-    char **pargv;
-    char **penviron;
-    posix_spawnattr_t attr;
-    posix_spawnattr_t *pattr;
-    posix_spawn_file_actions_t file_actions;
-    posix_spawn_file_actions_t *pfile_actions;
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
 
-    Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+    /* Keep signals on the janet threads. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, sigchld_main, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    p->close_signal = SIGTERM;
-    p->pid = -1;
-    p->exited = 1;
-    p->wstatus = 0;
+    if (err == 0)
+        goto done;
 
-    /* This function does not panic, it only has one exit point to simplify cleanup. */
-#define PSPAWN_ERROR(M) do { error_msg = M; goto done; } while (0);
-#define PSPAWN_ERRORF(M, V) do { want_errorf = 1; error_msg = M; error_ctx = V; goto done; } while (0);
-    want_errorf = 0;
-    error_msg = NULL;
-    error_ctx = janet_wrap_nil();
+    sigaction(SIGCHLD, &sigchld_prev, NULL);
+    errno = err;
 
-    pcmd = NULL;
-    pargv = NULL;
-    penviron = NULL;
+fail:
+    close(fds[0]);
+    close(fds[1]);
+    sigchld_pipe[0] = -1;
+    sigchld_pipe[1] = -1;
+    rc = -1;
 
-    pattr = NULL;
-    pfile_actions = NULL;
+done:
+    pthread_mutex_unlock(&sigchld_lock);
+    return rc;
+}
 
-    sigset_t sig_dflt_set;
-    sigset_t sig_mask_set;
+/*
+   Register a waiter woken on every SIGCHLD, returns the fd to listen on
+   or -1 with errno set. The waiter must be passed to sigchld_waiter_remove.
+*/
+static int sigchld_waiter_add(SigchldWaiter **out) {
+    if (sigchld_pipe_init() < 0)
+        return -1;
 
-    if (posix_spawnattr_init(&attr) != 0) {
-        PSPAWN_ERROR("unable to init attr set");
+    SigchldWaiter *w = (SigchldWaiter *)malloc(sizeof(SigchldWaiter));
+    if (!w) {
+        errno = ENOMEM;
+        return -1;
     }
-    pattr = &attr;
 
-    if (posix_spawn_file_actions_init(&file_actions) != 0) {
-        PSPAWN_ERROR("unable to init file actions set");
+    int fds[2];
+    if (nonblock_pipe(fds) < 0) {
+        free(w);
+        return -1;
     }
-    pfile_actions = &file_actions;
-
 
-    pcmd = arg_string(argv[0]);
-    if (!pcmd)
-        PSPAWN_ERRORF("%v is not a valid command", argv[0]);
+    w->fd = fds[1];
+    w->prev = NULL;
+    pthread_mutex_lock(&sigchld_lock);
+    w->next = sigchld_waiters;
+    if (sigchld_waiters)
+        sigchld_waiters->prev = w;
+    sigchld_waiters = w;
+    pthread_mutex_unlock(&sigchld_lock);
 
-    JanetView args = janet_getindexed(argv, 1);
+    *out = w;
+    return fds[0];
+}
 
-    pargv = calloc(args.len + 1, sizeof(char *));
-    if (!pargv)
-        PSPAWN_ERROR("no memory");
+static void sigchld_waiter_remove(SigchldWaiter *w) {
+    pthread_mutex_lock(&sigchld_lock);
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        sigchld_waiters = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    pthread_mutex_unlock(&sigchld_lock);
+    close(w->fd);
+    free(w);
+}
 
-    for (size_t i = 0; i < (size_t)args.len; i++) {
-        pargv[i] = (char *)arg_string(args.items[i]);
-        if (!pcmd)
-            PSPAWN_ERRORF("%v is not a valid argument", args.items[i]);
-    }
+/*
+   The optional central reaper. Once started, a reaper thread blocks in
+   waitid for any child and moves each exited child's status into a pid
+   table, so checking a process costs a table lookup and reaping costs a
+   waitid and a wait4 per exited child. Stops and continues are recorded
+   in the same table for wait-state. The table is sharded by pid so
+   threads waiting on different children rarely share a lock. Children
+   are registered in the table when they are spawned, the reaper collects
+   every child of the process but drops the status of unregistered ones,
+   so a reused pid never finds the status of a child we didn't start.
+*/
+typedef struct {
+    pid_t pid; /* 0 is an empty slot, -1 a removed entry. */
+    /* Tells apart the entries of children that had the same pid. */
+    unsigned gen;
+    int exited;
+    int wstatus;
+    struct rusage rusage;
+    /* The last stop or continue status, and how many there have been. */
+    int state;
+    unsigned seq;
+} ReapedChild;
 
-    if (!janet_checktype(argv[2], JANET_NUMBER))
-        PSPAWN_ERROR("close signal must be a number");
+/*
+   An async waiter, the reaper writes to fd once pid is in the table.
+   Owned by the waiting fiber and the shard list, freed by the last one.
+*/
+typedef struct ReapWaiter {
+    struct ReapWaiter *prev;
+    struct ReapWaiter *next;
+    pid_t pid;
+    int fd;
+    int refs;
+    int states; /* Also woken by stops and continues. */
+} ReapWaiter;
 
-    int close_signal_int = (int)janet_unwrap_number(argv[2]);
-    if (close_signal_int == -1)
-        PSPAWN_ERROR("invalid value for :close-signal");
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Broadcast when a child is added to the table. */
+    ReapedChild *table;
+    size_t cap;
+    size_t used;  /* Registered children. */
+    size_t tombs; /* Removed entries, they still lengthen probes until a rehash. */
+    unsigned gen; /* The last registration. */
+    ReapWaiter *waiters;
+} ReaperShard;
 
-    p->close_signal = close_signal_int;
+#define REAPER_SHARDS 16
 
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_idle_cond = PTHREAD_COND_INITIALIZER;
+static volatile int reaper_enabled = 0;
+static volatile int reaper_idle = 0;
+static ReaperShard reaper_shards[REAPER_SHARDS];
+/*
+   Held shared by a spawn until its child is registered, the reaper takes
+   it exclusively before dropping a child that is not in the table.
+*/
+static pthread_rwlock_t reaper_spawn_lock;
 
-    JanetView jfile_actions;
+static ReaperShard *reaper_shard(pid_t pid) {
+    return &reaper_shards[(size_t)pid & (REAPER_SHARDS - 1)];
+}
 
-    if (!janet_checktype(argv[3], JANET_NIL)) {
-        if (!janet_indexed_view(argv[3], &jfile_actions.items, &jfile_actions.len))
-            PSPAWN_ERROR("file action elements must be an indexed type");
+static size_t reaped_slot(pid_t pid, size_t cap) {
+    /* The low bits picked the shard. */
+    return ((size_t)(pid / REAPER_SHARDS) * 2654435761u) & (cap - 1);
+}
 
-        for (int i = 0; i < jfile_actions.len; i++) {
-            Janet t = jfile_actions.items[i];
+/*
+   Must be called with sh->lock held. Finds the registration gen of pid,
+   or with gen 0 the one whose child has not exited yet, there is at most
+   one as the pid is in use until it exits.
+*/
+static ReapedChild *reaped_find(ReaperShard *sh, pid_t pid, unsigned gen) {
+    if (!sh->cap)
+        return NULL;
 
-            JanetView r;
+    size_t i = reaped_slot(pid, sh->cap);
+    while (sh->table[i].pid) {
+        ReapedChild *c = &sh->table[i];
+        if (c->pid == pid && (gen ? c->gen == gen : !c->exited))
+            return c;
+        i = (i + 1) & (sh->cap - 1);
+    }
+    return NULL;
+}
 
-            if (!janet_indexed_view(t, &r.items, &r.len))
-                PSPAWN_ERROR("file action elements must be an indexed type");
+/* Must be called with sh->lock held. Returns NULL when out of memory. */
+static ReapedChild *reaped_add(ReaperShard *sh, pid_t pid) {
+    ReapedChild *c;
 
-            if (r.len < 1)
-                PSPAWN_ERROR("file action elements must be at least one element");
+    if ((sh->used + sh->tombs + 1) * 2 > sh->cap) {
+        /* The rehash drops removed entries, only registered ones need the room. */
+        size_t cap = sh->cap ? sh->cap : 64;
+        while ((sh->used + 1) * 4 > cap)
+            cap *= 2;
+        ReapedChild *table = calloc(cap, sizeof(ReapedChild));
+        if (!table)
+            return NULL;
+        sh->used = 0;
+        sh->tombs = 0;
+        for (size_t i = 0; i < sh->cap; i++) {
+            if (sh->table[i].pid <= 0)
+                continue;
+            size_t j = reaped_slot(sh->table[i].pid, cap);
+            while (table[j].pid)
+                j = (j + 1) & (cap - 1);
+            table[j] = sh->table[i];
+            sh->used++;
+        }
+        free(sh->table);
+        sh->table = table;
+        sh->cap = cap;
+    }
 
-            if (janet_keyeq(r.items[0], "dup2")) {
+    size_t i = reaped_slot(pid, sh->cap);
+    while (sh->table[i].pid > 0)
+        i = (i + 1) & (sh->cap - 1);
+    if (sh->table[i].pid < 0)
+        sh->tombs--;
+    sh->used++;
+    c = &sh->table[i];
+    memset(c, 0, sizeof(*c));
+    c->pid = pid;
+    return c;
+}
 
-                if (r.len != 3)
-                    PSPAWN_ERROR("dup2 file actions have 2 files elements");
+/* Must be called with sh->lock held. */
+static void reaped_remove(ReaperShard *sh, ReapedChild *c) {
+    c->pid = -1;
+    sh->used--;
+    sh->tombs++;
+}
 
-                for (int j = 1; j <= 2; j++)
-                    if (!janet_checkfile(r.items[j]))
-                        PSPAWN_ERRORF(":dup2 value must be a file, got %v", r.items[j]);
+/* Must be called with sh->lock held. Returns 1 if registration gen had exited and was removed. */
+static int reaped_take(ReaperShard *sh, pid_t pid, unsigned gen, int *wstatus, struct rusage *rusage) {
+    if (!gen)
+        return 0;
+    ReapedChild *c = reaped_find(sh, pid, gen);
+    if (!c || !c->exited)
+        return 0;
+    *wstatus = c->wstatus;
+    *rusage = c->rusage;
+    reaped_remove(sh, c);
+    return 1;
+}
 
-                if (posix_spawn_file_actions_adddup2(pfile_actions, fileno(janet_unwrapfile(r.items[1], NULL)), fileno(janet_unwrapfile(r.items[2], NULL))) != 0)
-                    PSPAWN_ERROR(":dup2 file action unable to determine fileno");
+/* Must be called with sh->lock held, drops the list's reference. */
+static void reap_waiter_unlink(ReaperShard *sh, ReapWaiter *w) {
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        sh->waiters = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    w->prev = NULL;
+    w->next = NULL;
+    close(w->fd);
+    w->fd = -1;
+    if (--w->refs == 0)
+        free(w);
+}
 
-            } else if (janet_keyeq(r.items[0], "close")) {
+/* Must be called with sh->lock held. */
+static void reap_waiters_wake(ReaperShard *sh, pid_t pid, int exited) {
+    ReapWaiter *w = sh->waiters;
+    while (w) {
+        ReapWaiter *next = w->next;
+        if (w->pid == pid && (exited || w->states)) {
+            ssize_t rc = write(w->fd, "", 1);
+            (void)rc; /* The pipe is fresh, it can't be full. */
+            reap_waiter_unlink(sh, w);
+        }
+        w = next;
+    }
+}
 
-                if (r.len != 2)
-                    PSPAWN_ERROR(":close file actions have 1 file");
+/*
+   Collect the state change waitid reported for pid under its shard lock.
+   Exited entries for the pid belong to earlier children whose handles
+   have not taken the status yet, only a live entry is this child's.
+*/
+static void reaper_reap(pid_t pid) {
+    ReaperShard *sh = reaper_shard(pid);
+    int exclusive = 0;
+    int wstatus;
+    struct rusage rusage;
+    pid_t rc;
 
-                if (!janet_checkfile(r.items[1]))
-                    PSPAWN_ERRORF(":close value must be a file, got %v", r.items[1]);
+    pthread_mutex_lock(&sh->lock);
+    ReapedChild *c = reaped_find(sh, pid, 0);
+    if (!c) {
+        /* A spawn in flight may not have registered it yet, let those finish. */
+        pthread_mutex_unlock(&sh->lock);
+        pthread_rwlock_wrlock(&reaper_spawn_lock);
+        exclusive = 1;
+        pthread_mutex_lock(&sh->lock);
+        c = reaped_find(sh, pid, 0);
+    }
 
-                if (posix_spawn_file_actions_addclose(pfile_actions, fileno(janet_unwrapfile(r.items[1], NULL))) != 0)
-                    PSPAWN_ERROR(":close file action unable to determine fileno");
+    do {
+        rc = wait4(pid, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &rusage);
+    } while (rc < 0 && errno == EINTR);
 
-            } else {
-                PSPAWN_ERRORF("%v is not a valid file action", r.items[0]);
-            }
+    /* Without an entry it is not a child we started, its status is dropped. */
+    if (rc > 0 && c) {
+        int exited = !WIFSTOPPED(wstatus) && !WIFCONTINUED(wstatus);
+        if (exited) {
+            c->exited = 1;
+            c->wstatus = wstatus;
+            c->rusage = rusage;
+        } else {
+            c->state = wstatus;
+            c->seq++;
         }
+        reap_waiters_wake(sh, pid, exited);
+        pthread_cond_broadcast(&sh->cond);
     }
+    pthread_mutex_unlock(&sh->lock);
+    if (exclusive)
+        pthread_rwlock_unlock(&reaper_spawn_lock);
+}
 
-    int32_t nenviron = 0;
+/* Sleep while we have no children, until a spawn calls reaper_kick. */
+static void reaper_idle_wait(void) {
+    pthread_mutex_lock(&reaper_lock);
+    reaper_idle = 1;
+    while (reaper_idle) {
+        /* A child spawned before the flag was visible to its spawner is seen here. */
+        siginfo_t info;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0)
+            break;
+        pthread_cond_wait(&reaper_idle_cond, &reaper_lock);
+    }
+    reaper_idle = 0;
+    pthread_mutex_unlock(&reaper_lock);
+}
 
-    if (!janet_checktype(argv[4], JANET_NIL)) {
+static void reaper_kick(void) {
+    if (!reaper_idle)
+        return;
+    pthread_mutex_lock(&reaper_lock);
+    reaper_idle = 0;
+    pthread_cond_signal(&reaper_idle_cond);
+    pthread_mutex_unlock(&reaper_lock);
+}
 
-        JanetDictView env;
+/* Call before a spawn, returns 1 if the spawn lock was taken for reaper_spawn_end. */
+static int reaper_spawn_begin(void) {
+    if (!reaper_enabled)
+        return 0;
+    pthread_rwlock_rdlock(&reaper_spawn_lock);
+    return 1;
+}
 
-        if (!janet_dictionary_view(argv[4], &env.kvs, &env.len, &env.cap))
-            PSPAWN_ERRORF("env must be a dictionary, got %v", argv[4]);
+static void reaper_spawn_end(int locked) {
+    if (locked)
+        pthread_rwlock_unlock(&reaper_spawn_lock);
+}
 
-        penviron = calloc((env.len + 1), sizeof(char *));
-        if (!penviron)
+/*
+   Add a child we started to the table, with the spawn lock held so the
+   reaper can't drop it first, and return its registration. Exits of
+   earlier children with the pid stay until their handles take them.
+   Without memory for the entry 0 is returned, the exit is dropped and
+   waiting for it fails.
+*/
+static unsigned reaper_register(pid_t pid) {
+    ReaperShard *sh = reaper_shard(pid);
+    unsigned gen = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    /* A live entry left for the pid lost its exit, the pid is ours now. */
+    ReapedChild *c = reaped_find(sh, pid, 0);
+    if (c)
+        reaped_remove(sh, c);
+    c = reaped_add(sh, pid);
+    if (c) {
+        if (++sh->gen == 0)
+            sh->gen = 1;
+        gen = c->gen = sh->gen;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    reaper_kick();
+    return gen;
+}
+
+static void *reaper_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        siginfo_t info;
+        int rc;
+
+        /* Find a child with a state change without taking it, that is done under its shard lock. */
+        memset(&info, 0, sizeof(info));
+        do {
+            rc = waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc < 0) {
+            if (errno == ECHILD)
+                reaper_idle_wait();
+            else
+                sleep_seconds(0.01);
+            continue;
+        }
+
+        if (info.si_pid > 0)
+            reaper_reap(info.si_pid);
+    }
+
+    return NULL;
+}
+
+/*
+   Must be called with p's shard lock held. Returns 1 if p's exit was
+   taken from the table or from another handle of p.
+*/
+static int reaper_take_exit(ReaperShard *sh, Process *p) {
+    /* Handles shared with other threads take the status in turn under this lock. */
+    if (reaped_take(sh, p->pid, p->reap_gen, &p->wstatus, &p->rusage)) {
+        process_shared_put(p);
+        return 1;
+    }
+    return process_shared_get(p);
+}
+
+/*
+   Wait for p using the reaper table.
+   Returns 1 if the process exited, 0 if it is still running,
+   or -1 and sets errno on error.
+*/
+static int reaper_wait(Process *p, int flags) {
+    ReaperShard *sh = reaper_shard(p->pid);
+    int found = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    for (;;) {
+        if (reaper_take_exit(sh, p)) {
+            found = 1;
+            break;
+        }
+        if (flags & WNOHANG)
+            break;
+
+        /* The reaper reaps under this lock, so ECHILD here means it's not ours. */
+        siginfo_t info;
+        if (waitid(P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 && errno == ECHILD) {
+            pthread_mutex_unlock(&sh->lock);
+            errno = ECHILD;
+            return -1;
+        }
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    return found;
+}
+
+enum {
+    PSTATE_NONE,
+    PSTATE_STOPPED,
+    PSTATE_CONTINUED,
+    PSTATE_EXITED,
+};
+
+static int process_state_event(int wstatus) {
+    if (WIFSTOPPED(wstatus))
+        return PSTATE_STOPPED;
+    if (WIFCONTINUED(wstatus))
+        return PSTATE_CONTINUED;
+    return PSTATE_EXITED;
+}
+
+/*
+   Wait for the next state change of p using the reaper table, changes
+   between calls are coalesced into the latest one. Sets *event to a
+   PSTATE_* value, returns -1 and sets errno on error.
+*/
+static int reaper_wait_state(Process *p, int flags, int *event) {
+    ReaperShard *sh = reaper_shard(p->pid);
+    int exited = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    for (;;) {
+        if (reaper_take_exit(sh, p)) {
+            exited = 1;
+            break;
+        }
+        ReapedChild *c = p->reap_gen ? reaped_find(sh, p->pid, p->reap_gen) : NULL;
+        if (c && c->seq != p->state_seq) {
+            p->state_seq = c->seq;
+            p->state_wstatus = c->state;
+            *event = process_state_event(c->state);
+            break;
+        }
+        if (flags & WNOHANG)
+            break;
+
+        siginfo_t info;
+        if (waitid(P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 && errno == ECHILD) {
+            pthread_mutex_unlock(&sh->lock);
+            errno = ECHILD;
+            return -1;
+        }
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (exited) {
+        process_set_exited(p);
+        *event = PSTATE_EXITED;
+    }
+    return 0;
+}
+
+/*
+   Register an async waiter for p, returns the read end of a pipe that
+   becomes readable once p's status can be taken, or -1 with errno set.
+*/
+static int reaper_waiter_add(Process *p, int states, ReapWaiter **out) {
+    int fds[2];
+
+    if (cloexec_pipe(fds) < 0)
+        return -1;
+
+    ReapWaiter *w = (ReapWaiter *)malloc(sizeof(ReapWaiter));
+    if (!w || fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+        int saved_errno = w ? errno : ENOMEM;
+        free(w);
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved_errno;
+        return -1;
+    }
+    w->pid = p->pid;
+    w->fd = fds[1];
+    w->refs = 2;
+    w->states = states;
+    w->prev = NULL;
+
+    ReaperShard *sh = reaper_shard(p->pid);
+    pthread_mutex_lock(&sh->lock);
+    w->next = sh->waiters;
+    if (w->next)
+        w->next->prev = w;
+    sh->waiters = w;
+    /* It may have exited before we were listening. */
+    ReapedChild *c = p->reap_gen ? reaped_find(sh, p->pid, p->reap_gen) : NULL;
+    if ((c && (c->exited || (states && c->seq != p->state_seq))) || process_shared_get(p))
+        reap_waiters_wake(sh, p->pid, 1);
+    pthread_mutex_unlock(&sh->lock);
+
+    *out = w;
+    return fds[0];
+}
+
+/*
+   Drop p's registration, so the reaper discards its exit. Returns 1
+   instead, with the status in p, if the reaper already recorded it.
+*/
+static int reaper_unregister(Process *p) {
+    ReaperShard *sh = reaper_shard(p->pid);
+    int exited;
+
+    pthread_mutex_lock(&sh->lock);
+    exited = reaped_take(sh, p->pid, p->reap_gen, &p->wstatus, &p->rusage);
+    if (!exited) {
+        ReapedChild *c = p->reap_gen ? reaped_find(sh, p->pid, p->reap_gen) : NULL;
+        if (c)
+            reaped_remove(sh, c);
+        /* Fibers already waiting on it find it released. */
+        reap_waiters_wake(sh, p->pid, 1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return exited;
+}
+
+static void reaper_waiter_remove(ReapWaiter *w) {
+    ReaperShard *sh = reaper_shard(w->pid);
+    pthread_mutex_lock(&sh->lock);
+    if (w->fd >= 0)
+        reap_waiter_unlink(sh, w);
+    if (--w->refs == 0)
+        free(w);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Returns -1 and sets errno on error. */
+static int reaper_start(void) {
+    int rc = 0;
+
+    pthread_mutex_lock(&reaper_lock);
+
+    if (reaper_enabled)
+        goto done;
+
+    for (int i = 0; i < REAPER_SHARDS; i++) {
+        ReaperShard *sh = &reaper_shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->cond, NULL);
+        sh->table = NULL;
+        sh->cap = 0;
+        sh->used = 0;
+        sh->tombs = 0;
+        sh->gen = 0;
+        sh->waiters = NULL;
+    }
+
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+#ifdef __GLIBC__
+    /* Spawns on many threads must not keep the reaper out indefinitely. */
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&reaper_spawn_lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    /* Keep signals on the janet threads. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, reaper_main, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        errno = err;
+        rc = -1;
+        goto done;
+    }
+
+    reaper_enabled = 1;
+
+done:
+    pthread_mutex_unlock(&reaper_lock);
+    return rc;
+}
+
+/*
+   Returns -1 and sets errno on error, otherwise returns the process exit code.
+*/
+
+static int process_wait(Process *p, int *exit, int flags) {
+    int _exit = 0;
+    if (!exit)
+        exit = &_exit;
+
+    if (p->pid == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Someone else reaps a released child, its status is never seen here. */
+    if (p->released) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    if (p->exited) {
+        *exit = process_exit_code(p);
+        return 0;
+    }
+
+    int err;
+
+    if (reaper_enabled) {
+        err = reaper_wait(p, flags);
+    } else if (p->shared) {
+        err = process_shared_wait(p, flags);
+    } else {
+        do {
+            err = wait4(p->pid, &p->wstatus, flags, &p->rusage);
+        } while (err < 0 && errno == EINTR);
+    }
+
+    if (err < 0)
+        return -1;
+
+    if ((flags & WNOHANG && err == 0)) {
+        *exit = -1;
+        return 0;
+    }
+
+    process_set_exited(p);
+    *exit = process_exit_code(p);
+    return 0;
+}
+
+/*
+   Wait for the next stop, continue or exit of p, setting *event to a
+   PSTATE_* value, PSTATE_NONE with WNOHANG when nothing happened.
+   Returns -1 and sets errno on error.
+*/
+static int process_wait_state(Process *p, int *event, int flags) {
+    *event = PSTATE_NONE;
+
+    if (p->pid == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (p->released) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    if (p->exited) {
+        *event = PSTATE_EXITED;
+        return 0;
+    }
+
+    if (reaper_enabled)
+        return reaper_wait_state(p, flags, event);
+
+    ProcShared *sh = p->shared;
+    int wstatus;
+    struct rusage rusage;
+    pid_t rc;
+
+    for (;;) {
+        if (!(flags & WNOHANG)) {
+            /* Block without taking the change, it is taken below under the shared lock. */
+            siginfo_t info;
+            int err;
+            do {
+                err = waitid(P_PID, p->pid, &info, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT);
+            } while (err < 0 && errno == EINTR);
+            if (err < 0 && errno != ECHILD)
+                return -1;
+        }
+
+        if (sh)
+            pthread_mutex_lock(&sh->lock);
+
+        if (sh && sh->exited) {
+            wstatus = sh->wstatus;
+            rusage = sh->rusage;
+            rc = p->pid;
+        } else {
+            do {
+                rc = wait4(p->pid, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &rusage);
+            } while (rc < 0 && errno == EINTR);
+            if (sh && rc > 0 && process_state_event(wstatus) == PSTATE_EXITED) {
+                sh->exited = 1;
+                sh->wstatus = wstatus;
+                sh->rusage = rusage;
+            }
+        }
+
+        int saved_errno = errno;
+        if (sh)
+            pthread_mutex_unlock(&sh->lock);
+
+        if (rc < 0) {
+            errno = saved_errno;
+            return -1;
+        }
+
+        /* Another handle may have taken the change we blocked for. */
+        if (rc == 0) {
+            if (flags & WNOHANG)
+                return 0;
+            continue;
+        }
+
+        *event = process_state_event(wstatus);
+        if (*event != PSTATE_EXITED) {
+            p->state_wstatus = wstatus;
+            return 0;
+        }
+
+        p->wstatus = wstatus;
+        p->rusage = rusage;
+        process_set_exited(p);
+        return 0;
+    }
+}
+
+/*
+   Send sig to target for p, its pid or -pgid. A zombie keeps its pid, but
+   once the reaper or another handle reaped p the pid can be reused, so an
+   exit recorded by them is taken first, under the lock they reap under,
+   and nothing is sent. Returns -1 and sets errno if kill failed.
+*/
+static int process_kill(Process *p, pid_t target, int sig) {
+    pthread_mutex_t *lock = NULL;
+    int exited = 0;
+    int rc = 0;
+
+    if (reaper_enabled) {
+        ReaperShard *sh = reaper_shard(p->pid);
+        lock = &sh->lock;
+        pthread_mutex_lock(lock);
+        exited = reaper_take_exit(sh, p);
+    } else if (p->shared) {
+        lock = &p->shared->lock;
+        pthread_mutex_lock(lock);
+        if (p->shared->exited) {
+            p->wstatus = p->shared->wstatus;
+            p->rusage = p->shared->rusage;
+            exited = 1;
+        }
+    }
+
+    if (!exited) {
+        do {
+            rc = kill(target, sig);
+        } while (rc < 0 && errno == EINTR);
+    }
+
+    int saved_errno = errno;
+    if (lock)
+        pthread_mutex_unlock(lock);
+    if (exited)
+        process_set_exited(p);
+    errno = saved_errno;
+    return rc;
+}
+
+static int process_signal(Process *p, int sig) {
+    if (p->exited || p->pid == -1)
+        return 0;
+
+    if (process_kill(p, p->pid, sig) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+   Send sig as part of closing p, to the whole process group with :close-group.
+   Only until a wait sees the leader exit, see process_set_exited.
+*/
+static int process_close_signal(Process *p, int sig) {
+    if (p->close_group && p->pgid > 0) {
+        if (process_kill(p, -p->pgid, sig) < 0 && errno != ESRCH)
+            return -1;
+
+        return 0;
+    }
+
+    return process_signal(p, sig);
+}
+
+/*
+   Wait up to timeout seconds for p to exit.
+   Returns 1 if it exited, 0 on timeout, -1 on error with errno set.
+*/
+static int process_wait_timeout(Process *p, double timeout) {
+    double deadline = monotonic_now() + timeout;
+    double backoff = 0.001;
+    int exit_code;
+
+    for (;;) {
+        if (process_wait(p, &exit_code, WNOHANG) != 0)
+            return -1;
+        if (exit_code != -1)
+            return 1;
+
+        double left = deadline - monotonic_now();
+        if (left <= 0)
+            return 0;
+
+        /* Short sleeps first, most children exit promptly once signalled. */
+        sleep_seconds(backoff < left ? backoff : left);
+        if (backoff < 0.05)
+            backoff *= 2;
+    }
+}
+
+/*
+   Children collected by the garbage collector are not waited for on the
+   gc path, they are handed to a background thread that reaps them, and
+   sends the kill signal to those still running after their close timeout.
+*/
+
+typedef struct GcChild {
+    struct GcChild *next;
+    Process p;
+    double deadline;
+} GcChild;
+
+static pthread_mutex_t gc_reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_reaper_cond = PTHREAD_COND_INITIALIZER;
+static GcChild *gc_reaper_children = NULL;
+static int gc_reaper_running = 0;
+
+/* Reaped nodes are kept for reuse, detached children come and go at the spawn rate. */
+#define GC_CHILD_FREE_MAX 64
+static GcChild *gc_child_free = NULL;
+static int gc_child_nfree = 0;
+
+/* Must be called with gc_reaper_lock held. */
+static GcChild *gc_child_alloc(void) {
+    GcChild *c = gc_child_free;
+    if (!c)
+        return (GcChild *)malloc(sizeof(GcChild));
+    gc_child_free = c->next;
+    gc_child_nfree--;
+    return c;
+}
+
+/* Must be called with gc_reaper_lock held. */
+static void gc_child_release(GcChild *c) {
+    if (gc_child_nfree >= GC_CHILD_FREE_MAX) {
+        free(c);
+        return;
+    }
+    c->next = gc_child_free;
+    gc_child_free = c;
+    gc_child_nfree++;
+}
+
+static void *gc_reaper_main(void *arg) {
+    (void)arg;
+    double backoff = 0.001;
+
+    pthread_mutex_lock(&gc_reaper_lock);
+    for (;;) {
+        while (!gc_reaper_children) {
+            pthread_cond_wait(&gc_reaper_cond, &gc_reaper_lock);
+            backoff = 0.001;
+        }
+
+        double now = monotonic_now();
+        GcChild **link = &gc_reaper_children;
+        while (*link) {
+            GcChild *c = *link;
+            int exit_code;
+
+            if (process_wait(&c->p, &exit_code, WNOHANG) != 0 || exit_code != -1) {
+                *link = c->next;
+                gc_child_release(c);
+                continue;
+            }
+
+            if (c->deadline >= 0 && now >= c->deadline) {
+                process_close_signal(&c->p, c->p.kill_signal);
+                c->deadline = -1;
+            }
+
+            link = &c->next;
+        }
+
+        if (gc_reaper_children) {
+            pthread_mutex_unlock(&gc_reaper_lock);
+            sleep_seconds(backoff);
+            if (backoff < 0.1)
+                backoff *= 2;
+            pthread_mutex_lock(&gc_reaper_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+   Hand p to the background thread, it is sent its kill signal if it is
+   still running after timeout seconds, never when timeout is negative.
+   Returns 0 on success, -1 if the child could not be handed off.
+*/
+static int gc_reaper_add(Process *p, double timeout) {
+    pthread_mutex_lock(&gc_reaper_lock);
+
+    GcChild *c = gc_child_alloc();
+    if (!c) {
+        pthread_mutex_unlock(&gc_reaper_lock);
+        return -1;
+    }
+
+    c->p = *p;
+    /* The copy outlives the handle, it must not point at its shared state. */
+    c->p.shared = NULL;
+    c->deadline = timeout < 0 ? -1 : monotonic_now() + timeout;
+
+    if (!gc_reaper_running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        sigset_t all, old;
+
+        /* Keep signals on the janet threads. */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        gc_reaper_running = pthread_create(&thread, &attr, gc_reaper_main, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (!gc_reaper_running) {
+            gc_child_release(c);
+            pthread_mutex_unlock(&gc_reaper_lock);
+            return -1;
+        }
+    }
+
+    c->next = gc_reaper_children;
+    gc_reaper_children = c;
+    pthread_cond_signal(&gc_reaper_cond);
+    pthread_mutex_unlock(&gc_reaper_lock);
+    return 0;
+}
+
+/*
+   Give up p without signalling it, a running child is reaped in the
+   background once it exits and the handle no longer reports on it.
+   Returns -1 and sets errno if p is shared with other threads or could
+   not be handed off.
+*/
+static int process_release(Process *p) {
+    if (p->released || p->pid == -1)
+        return 0;
+
+    if (p->shared) {
+        pthread_mutex_lock(&p->shared->lock);
+        int others = p->shared->refs > 1;
+        pthread_mutex_unlock(&p->shared->lock);
+        if (others) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    int exit_code = 0;
+    if (!p->exited && process_wait(p, &exit_code, WNOHANG) != 0)
+        return -1;
+
+    /* Already reaped, the handle keeps its status. */
+    if (exit_code != -1)
+        return 0;
+
+    if (reaper_enabled) {
+        /* The reaper discards the exit of an unregistered child, nothing has to poll for it. */
+        if (reaper_unregister(p)) {
+            process_set_exited(p);
+            return 0;
+        }
+        /* Its exit is never observed, stop counting it as live. */
+        stats_exited(p);
+    } else if (gc_reaper_add(p, -1) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    p->released = 1;
+    p->exited = 1;
+    p->close_group = 0;
+    return 0;
+}
+
+static int process_gc(void *ptr, size_t s) {
+    (void)s;
+
+    Process *p = (Process *)ptr;
+
+    /* Only the last handle of a shared process closes it. */
+    if (p->shared) {
+        ProcShared *sh = p->shared;
+        pthread_mutex_lock(&sh->lock);
+        int last = --sh->refs == 0;
+        if (!p->exited && sh->exited) {
+            p->exited = 1;
+            p->close_group = 0;
+            p->wstatus = sh->wstatus;
+            p->rusage = sh->rusage;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        if (!last)
+            return 0;
+        pthread_mutex_destroy(&sh->lock);
+        free(sh);
+        p->shared = NULL;
+    }
+
+    if (p->close_group)
+        process_close_signal(p, p->close_signal);
+    if (!p->exited && p->pid != -1) {
+        int exit_code;
+
+        if (!p->close_group)
+            process_close_signal(p, p->close_signal);
+
+        /* Never block the collector, reap in the background if it's still running. */
+        if (process_wait(p, &exit_code, WNOHANG) == 0 && exit_code == -1 && gc_reaper_add(p, p->close_timeout) < 0) {
+            /* Not much we can do here. */
+            process_close_signal(p, SIGKILL);
+            process_wait(p, NULL, 0);
+        }
+        p->exited = 1;
+    }
+    return 0;
+}
+
+
+static double timeval_seconds(struct timeval tv) {
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+static Janet process_rusage(Process *p) {
+    struct rusage *ru = &p->rusage;
+    JanetKV *st = janet_struct_begin(10);
+
+    janet_struct_put(st, janet_ckeywordv("utime"), janet_wrap_number(timeval_seconds(ru->ru_utime)));
+    janet_struct_put(st, janet_ckeywordv("stime"), janet_wrap_number(timeval_seconds(ru->ru_stime)));
+#ifdef __APPLE__
+    /* macOS reports bytes, everything else kilobytes. */
+    janet_struct_put(st, janet_ckeywordv("maxrss"), janet_wrap_number((double)(ru->ru_maxrss / 1024)));
+#else
+    janet_struct_put(st, janet_ckeywordv("maxrss"), janet_wrap_number((double)ru->ru_maxrss));
+#endif
+    janet_struct_put(st, janet_ckeywordv("minflt"), janet_wrap_number((double)ru->ru_minflt));
+    janet_struct_put(st, janet_ckeywordv("majflt"), janet_wrap_number((double)ru->ru_majflt));
+    janet_struct_put(st, janet_ckeywordv("inblock"), janet_wrap_number((double)ru->ru_inblock));
+    janet_struct_put(st, janet_ckeywordv("oublock"), janet_wrap_number((double)ru->ru_oublock));
+    janet_struct_put(st, janet_ckeywordv("nvcsw"), janet_wrap_number((double)ru->ru_nvcsw));
+    janet_struct_put(st, janet_ckeywordv("nivcsw"), janet_wrap_number((double)ru->ru_nivcsw));
+    janet_struct_put(st, janet_ckeywordv("nsignals"), janet_wrap_number((double)ru->ru_nsignals));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static Janet pspawn_close(int32_t argc, Janet *argv);
+static Janet pspawn_wait(int32_t argc, Janet *argv);
+static Janet pspawn_signal(int32_t argc, Janet *argv);
+
+static JanetMethod process_methods[] = {
+    {"close", pspawn_close}, /* So processes can be used with 'with' */
+    {"wait",  pspawn_wait},
+    {"signal", pspawn_signal},
+    {NULL, NULL}
+};
+
+static int process_get(void *ptr, Janet key, Janet *out) {
+    Process *p = (Process *)ptr;
+
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+
+    if (janet_keyeq(key, "pid")) {
+        *out = (p->pid == -1) ? janet_wrap_nil() : janet_wrap_integer(p->pid);
+        return 1;
+    }
+
+    if (janet_keyeq(key, "released")) {
+        *out = janet_wrap_boolean(p->released);
+        return 1;
+    }
+
+    /* A released child is reaped in the background, its exit is never seen. */
+    if (p->released && (janet_keyeq(key, "exit-code") || janet_keyeq(key, "rusage") || janet_keyeq(key, "term-signal"))) {
+        *out = janet_wrap_nil();
+        return 1;
+    }
+
+    if (p->released && janet_keyeq(key, "status")) {
+        *out = janet_ckeywordv("released");
+        return 1;
+    }
+
+    if (p->released && janet_keyeq(key, "core-dumped")) {
+        *out = janet_wrap_false();
+        return 1;
+    }
+
+    if (janet_keyeq(key, "pgid")) {
+        *out = (p->pgid <= 0) ? janet_wrap_nil() : janet_wrap_integer(p->pgid);
+        return 1;
+    }
+
+    if (janet_keyeq(key, "close-timeout")) {
+        *out = (p->close_timeout < 0) ? janet_wrap_nil() : janet_wrap_number(p->close_timeout);
+        return 1;
+    }
+
+    if (janet_keyeq(key, "kill-signal")) {
+        *out = janet_wrap_integer(p->kill_signal);
+        return 1;
+    }
+
+    if (janet_keyeq(key, "rusage")) {
+        int exit_code;
+
+        if (process_wait(p, &exit_code, WNOHANG) != 0)
+            janet_panicf("error checking exit status: %s", strerror(errno));
+
+        *out = (exit_code == -1) ? janet_wrap_nil() : process_rusage(p);
+        return 1;
+    }
+
+    if (janet_keyeq(key, "times")) {
+        if (!p->times.spawned) {
+            *out = janet_wrap_nil();
+            return 1;
+        }
+        JanetKV *st = janet_struct_begin(p->times.exited ? 4 : 3);
+        janet_struct_put(st, janet_ckeywordv("start"), janet_wrap_number((double)p->times.start));
+        janet_struct_put(st, janet_ckeywordv("spawn"), janet_wrap_number((double)p->times.spawn));
+        janet_struct_put(st, janet_ckeywordv("spawned"), janet_wrap_number((double)p->times.spawned));
+        if (p->times.exited)
+            janet_struct_put(st, janet_ckeywordv("exited"), janet_wrap_number((double)p->times.exited));
+        *out = janet_wrap_struct(janet_struct_end(st));
+        return 1;
+    }
+
+    if (janet_keyeq(key, "exit-code")) {
+        int exit_code;
+
+        if (process_wait(p, &exit_code, WNOHANG) != 0)
+            janet_panicf("error checking exit status: %s", strerror(errno));
+
+        *out = (exit_code == -1) ? janet_wrap_nil() : janet_wrap_integer(exit_code);
+        return 1;
+    }
+
+    /* The rest decode the wait status cached by the first wait to see the exit. */
+    if (janet_keyeq(key, "status") || janet_keyeq(key, "term-signal") || janet_keyeq(key, "core-dumped")) {
+        int exit_code;
+
+        if (process_wait(p, &exit_code, WNOHANG) != 0)
+            janet_panicf("error checking exit status: %s", strerror(errno));
+
+        int running = exit_code == -1;
+        int signaled = !running && WIFSIGNALED(p->wstatus);
+        int stopped = running && p->state_wstatus && WIFSTOPPED(p->state_wstatus);
+
+        if (janet_keyeq(key, "status")) {
+            *out = janet_ckeywordv(stopped ? "stopped" : running ? "running" : signaled ? "signaled" : "exited");
+        } else if (janet_keyeq(key, "term-signal")) {
+            *out = signaled ? janet_wrap_integer(WTERMSIG(p->wstatus)) : janet_wrap_nil();
+        } else {
+#ifdef WCOREDUMP
+            *out = janet_wrap_boolean(signaled && WCOREDUMP(p->wstatus));
+#else
+            *out = janet_wrap_false();
+#endif
+        }
+        return 1;
+    }
+
+    return janet_getmethod(janet_unwrap_keyword(key), process_methods, out);
+}
+
+/*
+   Processes can be sent to other threads, the handles share their exit
+   state so any of them can wait. Marshalling is only possible between
+   threads of this process, janet_marshal_ptr panics otherwise.
+*/
+static void process_marshal(void *ptr, JanetMarshalContext *ctx) {
+    Process *p = (Process *)ptr;
+
+    if (!p->shared) {
+        ProcShared *sh = (ProcShared *)malloc(sizeof(ProcShared));
+        if (!sh)
+            janet_panic("no memory");
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->refs = 1;
+        sh->exited = p->exited;
+        sh->wstatus = p->wstatus;
+        sh->rusage = p->rusage;
+        sh->stats_counted = p->exited;
+        p->shared = sh;
+    }
+
+    janet_marshal_abstract(ctx, p);
+    janet_marshal_ptr(ctx, p->shared);
+    janet_marshal_bytes(ctx, (const uint8_t *)p, sizeof(Process));
+
+    pthread_mutex_lock(&p->shared->lock);
+    p->shared->refs++;
+    pthread_mutex_unlock(&p->shared->lock);
+}
+
+static void *process_unmarshal(JanetMarshalContext *ctx) {
+    Process *p = (Process *)janet_unmarshal_abstract(ctx, sizeof(Process));
+    process_init(p, SIGTERM);
+    ProcShared *sh = (ProcShared *)janet_unmarshal_ptr(ctx);
+    janet_unmarshal_bytes(ctx, (uint8_t *)p, sizeof(Process));
+    p->shared = sh;
+    return p;
+}
+
+static const JanetAbstractType process_type = {
+    "posix-spawn/process", process_gc, NULL, process_get, NULL,
+    process_marshal, process_unmarshal, JANET_ATEND_UNMARSHAL
+};
+
+static const char *arg_string(Janet v) {
+    switch (janet_type(v)) {
+    case JANET_STRING:
+        return (const char *)janet_unwrap_string(v);
+    case JANET_SYMBOL:
+        return (const char *)janet_unwrap_symbol(v);
+    default:
+        return NULL;
+    }
+}
+
+enum {
+    FILE_ACTION_DUP2,
+    FILE_ACTION_CLOSE,
+    FILE_ACTION_OPEN,
+    FILE_ACTION_CHDIR,
+    FILE_ACTION_CLOSEFROM,
+};
+
+/*
+   Our own copy of the requested file actions, posix_spawn_file_actions_t is
+   opaque so we keep these to be able to extend an existing action list.
+*/
+typedef struct {
+    int kind;
+    int fd;
+    int newfd;
+    int flags;
+    mode_t mode;
+    const char *path; /* Borrowed from the janet string the action was parsed from. */
+} FileAction;
+
+typedef struct {
+    const char *msg;
+    int want_errorf;
+    Janet ctx;
+} SpawnError;
+
+static void spawn_error_panic(SpawnError *err) {
+    if (err->want_errorf)
+        janet_panicf(err->msg, err->ctx);
+    janet_panic(err->msg);
+}
+
+/*
+   Get the file descriptor of a file action argument.
+   Returns -2 if v is not a file, stream or fd, or -1 if it has no descriptor.
+*/
+static int file_action_fd(Janet v) {
+    if (janet_checkint(v)) {
+        int fd = (int)janet_unwrap_number(v);
+        return fd < 0 ? -2 : fd;
+    }
+
+    if (janet_checkfile(v)) {
+        FILE *f = janet_unwrapfile(v, NULL);
+        return f ? fileno(f) : -1;
+    }
+
+#ifdef JANET_EV
+    JanetStream *stream = (JanetStream *)janet_checkabstract(v, &janet_stream_type);
+    if (stream)
+        return (stream->flags & JANET_STREAM_CLOSED) ? -1 : stream->handle;
+#endif
+
+    return -2;
+}
+
+/* Returns NULL if v is not a string or has embedded nulls. */
+static const char *file_action_path(Janet v) {
+    if (!janet_checktype(v, JANET_STRING))
+        return NULL;
+
+    const uint8_t *path = janet_unwrap_string(v);
+    if (strlen((const char *)path) != (size_t)janet_string_length(path))
+        return NULL;
+
+    return (const char *)path;
+}
+
+/*
+   Parse a janet list of file actions, appending them to *pactions.
+   Returns 0 on success, otherwise fills in err and returns -1,
+   *pactions must be freed by the caller in both cases.
+*/
+static int file_actions_parse(Janet jactions, FileAction **pactions, int32_t *pnactions, SpawnError *err) {
+
+#define PSPAWN_ERROR(M) do { err->msg = M; return -1; } while (0);
+#define PSPAWN_ERRORF(M, V) do { err->want_errorf = 1; err->msg = M; err->ctx = V; return -1; } while (0);
+
+    JanetView jfile_actions;
+
+    if (janet_checktype(jactions, JANET_NIL))
+        return 0;
+
+    if (!janet_indexed_view(jactions, &jfile_actions.items, &jfile_actions.len))
+        PSPAWN_ERROR("file action elements must be an indexed type");
+
+    FileAction *actions = realloc(*pactions, (*pnactions + jfile_actions.len) * sizeof(FileAction));
+    if (!actions && (*pnactions + jfile_actions.len) != 0)
+        PSPAWN_ERROR("no memory");
+    *pactions = actions;
+
+    for (int i = 0; i < jfile_actions.len; i++) {
+        Janet t = jfile_actions.items[i];
+        FileAction *action = &actions[*pnactions];
+
+        JanetView r;
+
+        if (!janet_indexed_view(t, &r.items, &r.len))
+            PSPAWN_ERROR("file action elements must be an indexed type");
+
+        if (r.len < 1)
+            PSPAWN_ERROR("file action elements must be at least one element");
+
+        if (janet_keyeq(r.items[0], "dup2")) {
+
+            if (r.len != 3)
+                PSPAWN_ERROR("dup2 file actions have 2 files elements");
+
+            action->kind = FILE_ACTION_DUP2;
+            action->fd = file_action_fd(r.items[1]);
+            action->newfd = file_action_fd(r.items[2]);
+
+            for (int j = 1; j <= 2; j++)
+                if (file_action_fd(r.items[j]) == -2)
+                    PSPAWN_ERRORF(":dup2 value must be a file, stream or fd, got %v", r.items[j]);
+
+            if (action->fd < 0 || action->newfd < 0)
+                PSPAWN_ERROR(":dup2 file action unable to determine fileno");
+
+        } else if (janet_keyeq(r.items[0], "close")) {
+
+            if (r.len != 2)
+                PSPAWN_ERROR(":close file actions have 1 file");
+
+            action->kind = FILE_ACTION_CLOSE;
+            action->fd = file_action_fd(r.items[1]);
+
+            if (action->fd == -2)
+                PSPAWN_ERRORF(":close value must be a file, stream or fd, got %v", r.items[1]);
+
+            action->newfd = -1;
+            if (action->fd < 0)
+                PSPAWN_ERROR(":close file action unable to determine fileno");
+
+        } else if (janet_keyeq(r.items[0], "open")) {
+
+            if (r.len != 4 && r.len != 5)
+                PSPAWN_ERROR(":open file actions have an fd, path, flags and optional mode");
+
+            action->kind = FILE_ACTION_OPEN;
+            action->fd = file_action_fd(r.items[1]);
+            if (action->fd == -2)
+                PSPAWN_ERRORF(":open value must be a file, stream or fd, got %v", r.items[1]);
+            if (action->fd < 0)
+                PSPAWN_ERROR(":open file action unable to determine fileno");
+
+            action->path = file_action_path(r.items[2]);
+            if (!action->path)
+                PSPAWN_ERRORF(":open path must be a string without embedded nulls, got %v", r.items[2]);
+
+            if (!janet_checkint(r.items[3]))
+                PSPAWN_ERRORF(":open flags must be an integer, got %v", r.items[3]);
+            action->flags = (int)janet_unwrap_number(r.items[3]);
+
+            action->mode = 0666;
+            if (r.len == 5) {
+                if (!janet_checkint(r.items[4]))
+                    PSPAWN_ERRORF(":open mode must be an integer, got %v", r.items[4]);
+                action->mode = (mode_t)janet_unwrap_number(r.items[4]);
+            }
+
+        } else if (janet_keyeq(r.items[0], "chdir")) {
+
+            if (r.len != 2)
+                PSPAWN_ERROR(":chdir file actions have 1 directory");
+
+            action->kind = FILE_ACTION_CHDIR;
+            action->fd = -1;
+            action->newfd = -1;
+            action->path = file_action_path(r.items[1]);
+            if (!action->path)
+                PSPAWN_ERRORF(":chdir directory must be a string without embedded nulls, got %v", r.items[1]);
+
+        } else if (janet_keyeq(r.items[0], "close-from")) {
+
+            if (r.len != 2)
+                PSPAWN_ERROR(":close-from file actions have 1 fd");
+
+            if (!janet_checkint(r.items[1]) || janet_unwrap_number(r.items[1]) < 0)
+                PSPAWN_ERRORF(":close-from value must be a non negative integer, got %v", r.items[1]);
+
+            action->kind = FILE_ACTION_CLOSEFROM;
+            action->fd = (int)janet_unwrap_number(r.items[1]);
+            action->newfd = -1;
+
+        } else {
+            PSPAWN_ERRORF("%v is not a valid file action", r.items[0]);
+        }
+
+        *pnactions += 1;
+    }
+
+    return 0;
+
+#undef PSPAWN_ERRORF
+#undef PSPAWN_ERROR
+}
+
+#ifndef PSPAWN_HAVE_ADDCLOSEFROM
+/* Returns 1 if the actions leave fd set up in the child, by a dup2 or open not closed again. */
+static int file_actions_target(FileAction *actions, int32_t nactions, long fd) {
+    int target = 0;
+    for (int32_t i = 0; i < nactions; i++) {
+        if ((actions[i].kind == FILE_ACTION_DUP2 && actions[i].newfd == fd) ||
+                (actions[i].kind == FILE_ACTION_OPEN && actions[i].fd == fd))
+            target = 1;
+        else if (actions[i].kind == FILE_ACTION_CLOSE && actions[i].fd == fd)
+            target = 0;
+    }
+    return target;
+}
+
+/*
+   Without addclosefrom_np, close-from is emulated by adding a close action
+   for each descriptor >= lowfd that is open in the parent now and does
+   not already have FD_CLOEXEC set. Descriptors the earlier actions set up
+   in the child are skipped, whether or not the parent has them open.
+   Returns 0 on success, otherwise returns an error number.
+*/
+static int file_actions_add_closefrom(posix_spawn_file_actions_t *pfile_actions, int lowfd,
+                                      FileAction *earlier, int32_t nearlier) {
+    int rc = 0;
+
+#ifdef __linux__
+    DIR *d = opendir("/proc/self/fd");
+#else
+    DIR *d = opendir("/dev/fd");
+#endif
+
+    if (d) {
+        int dfd = dirfd(d);
+        struct dirent *ent;
+
+        while (rc == 0 && (ent = readdir(d))) {
+            char *end;
+            long fd = strtol(ent->d_name, &end, 10);
+            if (*end || end == ent->d_name || fd < lowfd || fd == dfd || file_actions_target(earlier, nearlier, fd))
+                continue;
+            int flags = fcntl((int)fd, F_GETFD);
+            if (flags < 0 || (flags & FD_CLOEXEC))
+                continue;
+            rc = posix_spawn_file_actions_addclose(pfile_actions, (int)fd);
+        }
+
+        closedir(d);
+        return rc;
+    }
+
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0)
+        maxfd = 1024;
+
+    for (long fd = lowfd; rc == 0 && fd < maxfd; fd++) {
+        if (file_actions_target(earlier, nearlier, fd))
+            continue;
+        int flags = fcntl((int)fd, F_GETFD);
+        if (flags < 0 || (flags & FD_CLOEXEC))
+            continue;
+        rc = posix_spawn_file_actions_addclose(pfile_actions, (int)fd);
+    }
+
+    return rc;
+}
+#endif
+
+/* Returns 0 on success, otherwise returns an error number. */
+static int file_actions_build(posix_spawn_file_actions_t *pfile_actions, FileAction *actions, int32_t nactions) {
+    int rc = 0;
+
+    for (int32_t i = 0; i < nactions && rc == 0; i++) {
+        switch (actions[i].kind) {
+        case FILE_ACTION_DUP2:
+            rc = posix_spawn_file_actions_adddup2(pfile_actions, actions[i].fd, actions[i].newfd);
+            break;
+        case FILE_ACTION_CLOSE:
+            rc = posix_spawn_file_actions_addclose(pfile_actions, actions[i].fd);
+            break;
+        case FILE_ACTION_CLOSEFROM:
+#ifdef PSPAWN_HAVE_ADDCLOSEFROM
+            rc = posix_spawn_file_actions_addclosefrom_np(pfile_actions, actions[i].fd);
+#else
+            rc = file_actions_add_closefrom(pfile_actions, actions[i].fd, actions, i);
+#endif
+            break;
+        case FILE_ACTION_OPEN:
+            rc = posix_spawn_file_actions_addopen(pfile_actions, actions[i].fd, actions[i].path, actions[i].flags, actions[i].mode);
+            break;
+#ifdef PSPAWN_HAVE_ADDCHDIR
+        case FILE_ACTION_CHDIR:
+            rc = posix_spawn_file_actions_addchdir_np(pfile_actions, actions[i].path);
+            break;
+#endif
+        default:
+            rc = EINVAL;
+        }
+    }
+
+    return rc;
+}
+
+extern char **environ;
+
+/*
+   Children spawned with the parent environment are passed environ as it
+   is. libc setenv and putenv don't take any lock of ours, so like any
+   posix_spawn caller we can't keep other threads from changing it meanwhile.
+*/
+static int environ_key_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        if (*a == '=')
+            return 1;
+        a++;
+        b++;
+    }
+    return (*a == '=' || *a == 0) && (*b == '=' || *b == 0);
+}
+
+static Janet opt_get(Janet opts, const char *name) {
+    if (janet_checktype(opts, JANET_NIL))
+        return janet_wrap_nil();
+    return janet_get(opts, janet_ckeywordv(name));
+}
+
+/* Returns 1 if posix_spawn can perform all the file actions on this platform. */
+static int file_actions_posix_ok(FileAction *actions, int32_t nactions) {
+#ifdef PSPAWN_HAVE_ADDCHDIR
+    (void)actions;
+    (void)nactions;
+#else
+    for (int32_t i = 0; i < nactions; i++)
+        if (actions[i].kind == FILE_ACTION_CHDIR)
+            return 0;
+#endif
+    return 1;
+}
+
+enum {
+    ENGINE_POSIX,
+    ENGINE_VFORK,
+};
+
+typedef struct {
+    int resource;
+    struct rlimit limit;
+} SpawnRlimit;
+
+/*
+   A helper process that starts children for us from its own small address
+   space, requests and replies go over a unix socket in order.
+*/
+typedef struct {
+    int fd; /* -1 once closed. */
+    pthread_mutex_t lock;
+    Janet helper;
+} ForkServer;
+
+#ifdef PSPAWN_HAVE_FORKSERVER
+static int forkserver_gc(void *ptr, size_t s) {
+    (void)s;
+    ForkServer *fs = (ForkServer *)ptr;
+    /* The helper exits when it reads EOF. */
+    if (fs->fd >= 0)
+        close(fs->fd);
+    pthread_mutex_destroy(&fs->lock);
+    return 0;
+}
+
+static int forkserver_gcmark(void *ptr, size_t s) {
+    (void)s;
+    ForkServer *fs = (ForkServer *)ptr;
+    janet_mark(fs->helper);
+    return 0;
+}
+
+static const JanetAbstractType forkserver_type;
+
+static Janet pspawn_forkserver_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ForkServer *fs = (ForkServer *)janet_getabstract(argv, 0, &forkserver_type);
+
+    pthread_mutex_lock(&fs->lock);
+    if (fs->fd >= 0) {
+        close(fs->fd);
+        fs->fd = -1;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (!janet_checkabstract(fs->helper, &process_type))
+        return janet_wrap_nil();
+
+    int exit_code;
+    if (process_wait((Process *)janet_unwrap_abstract(fs->helper), &exit_code, 0) != 0)
+        janet_panicf("error waiting for forkserver: %s", strerror(errno));
+
+    return janet_wrap_integer(exit_code);
+}
+
+static JanetMethod forkserver_methods[] = {
+    {"close", pspawn_forkserver_close},
+    {NULL, NULL}
+};
+
+static int forkserver_get(void *ptr, Janet key, Janet *out) {
+    ForkServer *fs = (ForkServer *)ptr;
+
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+
+    if (janet_keyeq(key, "helper")) {
+        *out = fs->helper;
+        return 1;
+    }
+
+    return janet_getmethod(janet_unwrap_keyword(key), forkserver_methods, out);
+}
+
+static const JanetAbstractType forkserver_type = {
+    "posix-spawn/forkserver", forkserver_gc, forkserver_gcmark, forkserver_get, JANET_ATEND_GET
+};
+#endif
+
+/* Searched like execvp when PATH is unset. */
+#define PSPAWN_DEFAULT_PATH "/usr/local/bin:/bin:/usr/bin"
+
+/*
+   Optional cache of PATH lookups, off until enabled with
+   posix-spawn/path-cache. Entries are keyed by the command and the PATH it
+   was searched in, and the inode they resolved to is checked before each
+   use so a replaced or removed binary is searched for again.
+*/
+#define PATH_CACHE_SIZE 64
+
+typedef struct {
+    char *key; /* The command, a NUL, then the PATH. */
+    size_t keylen;
+    char *resolved;
+    dev_t dev;
+    ino_t ino;
+} PathCacheEntry;
+
+static volatile int path_cache_enabled = 0;
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static PathCacheEntry path_cache[PATH_CACHE_SIZE];
+
+static int path_executable(const char *file, struct stat *st) {
+    return stat(file, st) == 0 && S_ISREG(st->st_mode) && access(file, X_OK) == 0;
+}
+
+static void path_cache_clear(void) {
+    pthread_mutex_lock(&path_cache_lock);
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        free(path_cache[i].key);
+        free(path_cache[i].resolved);
+        path_cache[i].key = NULL;
+        path_cache[i].resolved = NULL;
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+   Search path for an executable cmd, leaving its path in buf. *cacheable
+   is cleared when a relative PATH element was searched, the result then
+   depends on the working directory. Returns -1 with errno set if there is none.
+*/
+static int path_search(const char *cmd, const char *path, char *buf, struct stat *st, int *cacheable) {
+    size_t cmdlen = strlen(cmd);
+
+    *cacheable = 1;
+
+    for (const char *dir = path;;) {
+        const char *end = strchr(dir, ':');
+        size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+
+        if (!dirlen || dir[0] != '/')
+            *cacheable = 0;
+
+        if (dirlen + cmdlen + 2 <= PATH_MAX) {
+            /* An empty path element means the current directory. */
+            size_t n = 0;
+            if (dirlen) {
+                memcpy(buf, dir, dirlen);
+                buf[dirlen] = '/';
+                n = dirlen + 1;
+            }
+            memcpy(buf + n, cmd, cmdlen + 1);
+
+            if (path_executable(buf, st))
+                return 0;
+        }
+
+        if (!end)
+            break;
+        dir = end + 1;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+   Resolve cmd against path like execvp, through the cache when it is enabled.
+   buf must hold PATH_MAX bytes. Returns -1 with errno set if cmd was not found.
+*/
+static int path_resolve(const char *cmd, const char *path, char *buf) {
+    struct stat st;
+    int cacheable;
+
+    if (strchr(cmd, '/')) {
+        if (strlen(cmd) >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (!path_executable(cmd, &st)) {
+            errno = ENOENT;
+            return -1;
+        }
+        strcpy(buf, cmd);
+        return 0;
+    }
+
+    if (!path)
+        path = PSPAWN_DEFAULT_PATH;
+
+    if (!path_cache_enabled)
+        return path_search(cmd, path, buf, &st, &cacheable);
+
+    size_t cmdlen = strlen(cmd);
+    size_t pathlen = strlen(path);
+    size_t keylen = cmdlen + 1 + pathlen;
+
+    /* FNV-1a over the key. */
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i <= cmdlen; i++)
+        hash = (hash ^ (unsigned char)cmd[i]) * 1099511628211u;
+    for (size_t i = 0; i < pathlen; i++)
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211u;
+    PathCacheEntry *e = &path_cache[hash % PATH_CACHE_SIZE];
+
+    int hit = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+
+    pthread_mutex_lock(&path_cache_lock);
+    if (e->key && e->keylen == keylen && memcmp(e->key, cmd, cmdlen + 1) == 0 &&
+            memcmp(e->key + cmdlen + 1, path, pathlen) == 0) {
+        strcpy(buf, e->resolved);
+        dev = e->dev;
+        ino = e->ino;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+
+    if (hit && path_executable(buf, &st) && st.st_dev == dev && st.st_ino == ino)
+        return 0;
+
+    if (path_search(cmd, path, buf, &st, &cacheable) != 0)
+        return -1;
+
+    if (!cacheable)
+        return 0;
+
+    size_t rlen = strlen(buf);
+    char *key = malloc(keylen);
+    char *resolved = malloc(rlen + 1);
+    if (!key || !resolved) {
+        /* Not caching is fine. */
+        free(key);
+        free(resolved);
+        return 0;
+    }
+    memcpy(key, cmd, cmdlen + 1);
+    memcpy(key + cmdlen + 1, path, pathlen);
+    memcpy(resolved, buf, rlen + 1);
+
+    pthread_mutex_lock(&path_cache_lock);
+    free(e->key);
+    free(e->resolved);
+    e->key = key;
+    e->keylen = keylen;
+    e->resolved = resolved;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    pthread_mutex_unlock(&path_cache_lock);
+
+    return 0;
+}
+
+/*
+   An executable opened once by posix-spawn/open-exe, passed as the cmd
+   it is exec'd by fd so every child runs the same file.
+*/
+typedef struct {
+    int fd; /* -1 once closed. */
+    char *path;
+} Exe;
+
+static int exe_gc(void *ptr, size_t s) {
+    (void)s;
+    Exe *e = (Exe *)ptr;
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e->path);
+    return 0;
+}
+
+static const JanetAbstractType exe_type;
+
+static Janet pspawn_exe_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    Exe *e = (Exe *)janet_getabstract(argv, 0, &exe_type);
+    if (e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+    }
+    return janet_wrap_nil();
+}
+
+static JanetMethod exe_methods[] = {
+    {"close", pspawn_exe_close},
+    {NULL, NULL}
+};
+
+static int exe_get(void *ptr, Janet key, Janet *out) {
+    Exe *e = (Exe *)ptr;
+
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+
+    if (janet_keyeq(key, "fd")) {
+        *out = e->fd >= 0 ? janet_wrap_integer(e->fd) : janet_wrap_nil();
+        return 1;
+    }
+
+    if (janet_keyeq(key, "path")) {
+        *out = janet_cstringv(e->path);
+        return 1;
+    }
+
+    return janet_getmethod(janet_unwrap_keyword(key), exe_methods, out);
+}
+
+static const JanetAbstractType exe_type = {
+    "posix-spawn/exe", exe_gc, NULL, exe_get, JANET_ATEND_GET
+};
+
+static Janet pspawn_open_exe(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *cmd = janet_getcstring(argv, 0);
+    char path[PATH_MAX];
+
+#ifndef PSPAWN_HAVE_FEXECVE
+    janet_panic("open-exe is not supported on this platform");
+#endif
+
+    if (path_resolve(cmd, getenv("PATH"), path) != 0)
+        janet_panicf("unable to find %s - %s", cmd, strerror(errno));
+
+#if defined(__linux__) && defined(O_PATH)
+    /* execveat takes an O_PATH fd, so execute only binaries work too. */
+    int fd = open(path, O_PATH | O_CLOEXEC);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0)
+        janet_panicf("unable to open %s - %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        janet_panicf("%s is not a regular file", path);
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        close(fd);
+        janet_panic("no memory");
+    }
+
+    Exe *e = (Exe *)janet_abstract(&exe_type, sizeof(Exe));
+    e->fd = fd;
+    e->path = copy;
+    return janet_wrap_abstract(e);
+}
+
+/*
+   A parsed spawn request, everything posix_spawnp needs is prepared up front
+   so the same spec can be used to start any number of children.
+*/
+typedef struct {
+    int engine;
+    const char *cmd;
+    char **argv;
+    char **environ;
+    void *arena; /* Holds the argv and environ arrays and the environ strings. */
+    int close_signal;
+    FileAction *actions;
+    int32_t nactions;
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *pattr;
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_t *pfile_actions;
+    /* The vfork engine applies these itself instead of using the attr set. */
+    short attr_flags;
+    sigset_t sig_default;
+    sigset_t sig_mask;
+    /* -1 to stay in our process group, 0 for a new group, otherwise the group to join. */
+    pid_t pgroup;
+    int setsid;
+    int close_group;
+    double close_timeout;
+    int kill_signal;
+    int shell_exit_codes;
+    /* Release children as soon as they are started. */
+    int detached;
+    /* Applied by the vfork engine, posix_spawn has no attrs for them. */
+    SpawnRlimit *rlimits;
+    int32_t nrlimits;
+    int set_nice;
+    int nice;
+#ifdef __linux__
+    int set_affinity;
+    cpu_set_t affinity;
+#endif
+    /* -1 to inherit the policy, set_sched_param alone keeps it and changes the priority. */
+    int sched_policy;
+    int set_sched_param;
+    struct sched_param sched_param;
+    /* An O_DIRECTORY fd of the cgroup to start the child in, or -1. */
+    int cgroup_fd;
+    /* Borrowed from the spawn options, children are started by this helper. */
+    ForkServer *forkserver;
+    /* The forkserver side, the PATH to search and whether children are our parent's. */
+    const char *path;
+    int clone_parent;
+    /* Borrowed from the cmd, exec'd by fd instead of searching for cmd. */
+    Exe *exe;
+} SpawnSpec;
+
+static void spawn_spec_deinit(SpawnSpec *s) {
+    if (s->arena) {
+        free(s->arena);
+        s->arena = NULL;
+        s->argv = NULL;
+        s->environ = NULL;
+    }
+
+    if (s->actions) {
+        free(s->actions);
+        s->actions = NULL;
+    }
+
+    if (s->rlimits) {
+        free(s->rlimits);
+        s->rlimits = NULL;
+    }
+
+    if (s->cgroup_fd >= 0) {
+        close(s->cgroup_fd);
+        s->cgroup_fd = -1;
+    }
+
+    if (s->pfile_actions) {
+        posix_spawn_file_actions_destroy(s->pfile_actions);
+        s->pfile_actions = NULL;
+    }
+
+    if (s->pattr) {
+        posix_spawnattr_destroy(s->pattr);
+        s->pattr = NULL;
+    }
+}
+
+static const struct {
+    const char *name;
+    int resource;
+} rlimit_names[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"nofile", RLIMIT_NOFILE},
+    {"stack", RLIMIT_STACK},
+#ifdef RLIMIT_NPROC
+    {"nproc", RLIMIT_NPROC},
+#endif
+#ifdef RLIMIT_MEMLOCK
+    {"memlock", RLIMIT_MEMLOCK},
+#endif
+#ifdef RLIMIT_RSS
+    {"rss", RLIMIT_RSS},
+#endif
+};
+
+static const struct {
+    const char *name;
+    int policy;
+} sched_policy_names[] = {
+    {"other", SCHED_OTHER},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR},
+#ifdef SCHED_BATCH
+    {"batch", SCHED_BATCH},
+#endif
+#ifdef SCHED_IDLE
+    {"idle", SCHED_IDLE},
+#endif
+};
+
+static int rlimit_value(Janet v, rlim_t *out) {
+    if (janet_keyeq(v, "infinity")) {
+        *out = RLIM_INFINITY;
+        return 0;
+    }
+    if (!janet_checktype(v, JANET_NUMBER) || janet_unwrap_number(v) < 0)
+        return -1;
+    *out = (rlim_t)janet_unwrap_number(v);
+    return 0;
+}
+
+/*
+   Parse :rlimits, :nice, :cpu-affinity, :sched-policy and :sched-param from opts.
+   Sets *vfork_reason to the first option only the vfork engine can apply.
+   Returns 0 on success, otherwise fills in err and returns -1.
+*/
+static int spawn_spec_sched_init(SpawnSpec *s, Janet opts, Janet *vfork_reason, SpawnError *err) {
+
+#define PSPAWN_ERROR(M) do { err->msg = M; return -1; } while (0);
+#define PSPAWN_ERRORF(M, V) do { err->want_errorf = 1; err->msg = M; err->ctx = V; return -1; } while (0);
+
+    Janet jrlimits = opt_get(opts, "rlimits");
+    if (!janet_checktype(jrlimits, JANET_NIL)) {
+        const JanetKV *kvs;
+        int32_t len, cap;
+        if (!janet_dictionary_view(jrlimits, &kvs, &len, &cap))
+            PSPAWN_ERRORF(":rlimits must be a dictionary, got %v", jrlimits);
+
+        s->rlimits = malloc(sizeof(SpawnRlimit) * (len ? len : 1));
+        if (!s->rlimits)
             PSPAWN_ERROR("no memory");
 
-        for (int32_t i = 0; i < env.cap; i++) {
-            const JanetKV *kv = env.kvs + i;
+        for (int32_t i = 0; i < cap; i++) {
+            const JanetKV *kv = kvs + i;
+            if (janet_checktype(kv->key, JANET_NIL))
+                continue;
+
+            SpawnRlimit *r = &s->rlimits[s->nrlimits];
+            size_t j;
+            for (j = 0; j < sizeof(rlimit_names) / sizeof(rlimit_names[0]); j++)
+                if (janet_keyeq(kv->key, rlimit_names[j].name))
+                    break;
+            if (j == sizeof(rlimit_names) / sizeof(rlimit_names[0]))
+                PSPAWN_ERRORF("%v is not a supported rlimit", kv->key);
+            r->resource = rlimit_names[j].resource;
+
+            /* A single value sets both limits, [soft hard] sets them separately. */
+            JanetView pair;
+            if (janet_indexed_view(kv->value, &pair.items, &pair.len)) {
+                if (pair.len != 2 || rlimit_value(pair.items[0], &r->limit.rlim_cur) != 0
+                        || rlimit_value(pair.items[1], &r->limit.rlim_max) != 0)
+                    PSPAWN_ERRORF("invalid rlimit %v", kv->value);
+            } else {
+                if (rlimit_value(kv->value, &r->limit.rlim_cur) != 0)
+                    PSPAWN_ERRORF("invalid rlimit %v", kv->value);
+                r->limit.rlim_max = r->limit.rlim_cur;
+            }
+
+            s->nrlimits++;
+        }
+
+        if (s->nrlimits)
+            *vfork_reason = janet_ckeywordv("rlimits");
+    }
+
+    Janet jnice = opt_get(opts, "nice");
+    if (!janet_checktype(jnice, JANET_NIL)) {
+        if (!janet_checkint(jnice))
+            PSPAWN_ERRORF(":nice must be an integer, got %v", jnice);
+        s->set_nice = 1;
+        s->nice = (int)janet_unwrap_number(jnice);
+        if (janet_checktype(*vfork_reason, JANET_NIL))
+            *vfork_reason = janet_ckeywordv("nice");
+    }
+
+    Janet jaffinity = opt_get(opts, "cpu-affinity");
+    if (!janet_checktype(jaffinity, JANET_NIL)) {
+#ifdef __linux__
+        JanetView cpus;
+        if (!janet_indexed_view(jaffinity, &cpus.items, &cpus.len) || cpus.len == 0)
+            PSPAWN_ERRORF(":cpu-affinity must be a non empty list of cpus, got %v", jaffinity);
+        CPU_ZERO(&s->affinity);
+        for (int32_t i = 0; i < cpus.len; i++) {
+            if (!janet_checkint(cpus.items[i]) || janet_unwrap_number(cpus.items[i]) < 0
+                    || janet_unwrap_number(cpus.items[i]) >= CPU_SETSIZE)
+                PSPAWN_ERRORF("invalid cpu %v", cpus.items[i]);
+            CPU_SET((int)janet_unwrap_number(cpus.items[i]), &s->affinity);
+        }
+        s->set_affinity = 1;
+        if (janet_checktype(*vfork_reason, JANET_NIL))
+            *vfork_reason = janet_ckeywordv("cpu-affinity");
+#else
+        PSPAWN_ERROR(":cpu-affinity is only supported on linux");
+#endif
+    }
+
+    Janet jpolicy = opt_get(opts, "sched-policy");
+    if (!janet_checktype(jpolicy, JANET_NIL)) {
+        size_t j;
+        for (j = 0; j < sizeof(sched_policy_names) / sizeof(sched_policy_names[0]); j++)
+            if (janet_keyeq(jpolicy, sched_policy_names[j].name))
+                break;
+        if (j == sizeof(sched_policy_names) / sizeof(sched_policy_names[0]))
+            PSPAWN_ERRORF("%v is not a supported :sched-policy", jpolicy);
+        s->sched_policy = sched_policy_names[j].policy;
+    }
+
+    Janet jparam = opt_get(opts, "sched-param");
+    memset(&s->sched_param, 0, sizeof(s->sched_param));
+    if (!janet_checktype(jparam, JANET_NIL)) {
+        if (!janet_checkint(jparam))
+            PSPAWN_ERRORF(":sched-param must be an integer priority, got %v", jparam);
+        s->sched_param.sched_priority = (int)janet_unwrap_number(jparam);
+        s->set_sched_param = 1;
+    }
+
+#if !defined(POSIX_SPAWN_SETSCHEDULER) || !defined(POSIX_SPAWN_SETSCHEDPARAM)
+    if ((s->sched_policy >= 0 || s->set_sched_param) && janet_checktype(*vfork_reason, JANET_NIL))
+        *vfork_reason = janet_ckeywordv("sched-policy");
+#endif
+
+    return 0;
+
+#undef PSPAWN_ERRORF
+#undef PSPAWN_ERROR
+}
+
+/*
+   Fill in a spawn spec from the primitive spawn arguments:
+
+   cmd args close-signal file-actions env attr-flags sig-default sig-mask opts
+
+   opts is the dictionary of spawn keyword args, it is consulted for options
+   that have no positional argument.
+
+   When env is nil the child gets environ as it is when the spec is
+   spawned, or when :env-overlay is set, the overlay is merged onto a copy
+   of the current environ now.
+
+   With no :engine option the posix engine is used, unless the spec needs
+   something only the vfork engine can do.
+
+   This function does not panic, returns 0 on success, otherwise fills in err
+   and returns -1. The spec must be passed to spawn_spec_deinit in both cases.
+*/
+static int spawn_spec_init(SpawnSpec *s, const Janet *argv, SpawnError *err) {
+
+#define PSPAWN_ERROR(M) do { err->msg = M; return -1; } while (0);
+#define PSPAWN_ERRORF(M, V) do { err->want_errorf = 1; err->msg = M; err->ctx = V; return -1; } while (0);
+    err->want_errorf = 0;
+    err->msg = NULL;
+    err->ctx = janet_wrap_nil();
+
+    s->engine = ENGINE_POSIX;
+    s->cmd = NULL;
+    s->argv = NULL;
+    s->environ = NULL;
+    s->arena = NULL;
+    s->close_signal = SIGTERM;
+    s->actions = NULL;
+    s->nactions = 0;
+    s->pattr = NULL;
+    s->pfile_actions = NULL;
+    s->pgroup = -1;
+    s->setsid = 0;
+    s->close_group = 0;
+    s->close_timeout = -1;
+    s->kill_signal = SIGKILL;
+    s->shell_exit_codes = 0;
+    s->detached = 0;
+    s->rlimits = NULL;
+    s->nrlimits = 0;
+    s->set_nice = 0;
+    s->nice = 0;
+#ifdef __linux__
+    s->set_affinity = 0;
+#endif
+    s->sched_policy = -1;
+    s->set_sched_param = 0;
+    s->cgroup_fd = -1;
+    s->forkserver = NULL;
+    s->path = NULL;
+    s->clone_parent = 0;
+    s->exe = NULL;
+
+    sigset_t sig_dflt_set;
+    sigset_t sig_mask_set;
+
+    if (posix_spawnattr_init(&s->attr) != 0) {
+        PSPAWN_ERROR("unable to init attr set");
+    }
+    s->pattr = &s->attr;
+
+    if (posix_spawn_file_actions_init(&s->file_actions) != 0) {
+        PSPAWN_ERROR("unable to init file actions set");
+    }
+    s->pfile_actions = &s->file_actions;
+
+    s->exe = (Exe *)janet_checkabstract(argv[0], &exe_type);
+    s->cmd = s->exe ? s->exe->path : arg_string(argv[0]);
+    if (!s->cmd)
+        PSPAWN_ERRORF("%v is not a valid command", argv[0]);
+
+    JanetView args;
+
+    if (!janet_indexed_view(argv[1], &args.items, &args.len))
+        PSPAWN_ERRORF("args must be an indexed type, got %v", argv[1]);
+
+    for (int32_t i = 0; i < args.len; i++) {
+        if (!arg_string(args.items[i]))
+            PSPAWN_ERRORF("%v is not a valid argument", args.items[i]);
+    }
+
+    Janet jenv = argv[4];
+    Janet joverlay = opt_get(argv[8], "env-overlay");
+
+    if (!janet_checktype(jenv, JANET_NIL) && !janet_checktype(joverlay, JANET_NIL))
+        PSPAWN_ERROR(":env and :env-overlay cannot be used together");
+
+    if (janet_checktype(jenv, JANET_NIL))
+        jenv = joverlay;
+
+    JanetDictView env = {NULL, 0, 0};
+    int32_t nbase = 0;
+    size_t env_bytes = 0;
+
+    if (!janet_checktype(jenv, JANET_NIL)) {
+
+        if (!janet_dictionary_view(jenv, &env.kvs, &env.len, &env.cap))
+            PSPAWN_ERRORF("env must be a dictionary, got %v", jenv);
+
+        for (int32_t i = 0; i < env.cap; i++) {
+            const JanetKV *kv = env.kvs + i;
+
+            if (janet_checktype(kv->key, JANET_NIL))
+                continue;
+
+            if (!janet_checktype(kv->key, JANET_STRING))
+                PSPAWN_ERROR("environ key is not a string");
+
+            if (!janet_checktype(kv->value, JANET_STRING))
+                PSPAWN_ERROR("environ value is not a string");
+
+            const uint8_t *keys = janet_unwrap_string(kv->key);
+            const uint8_t *vals = janet_unwrap_string(kv->value);
+            size_t klen = janet_string_length(keys);
+            size_t vlen = janet_string_length(vals);
+
+            if (strlen((char *)keys) != klen)
+                PSPAWN_ERROR("environ keys cannot have embedded nulls");
+
+            if (strlen((char *)vals) != vlen)
+                PSPAWN_ERROR("environ values cannot have embedded nulls");
+
+            env_bytes += klen + vlen + 2;
+        }
+
+        /* The base entries are copied into the arena with the overlay. */
+        if (!janet_checktype(joverlay, JANET_NIL)) {
+            for (; environ && environ[nbase]; nbase++)
+                env_bytes += strlen(environ[nbase]) + 1;
+        }
+    }
+
+    /* Everything is sized, so argv and environ can share a single allocation. */
+    size_t nargv = (size_t)args.len + 1;
+    size_t nenviron = janet_checktype(jenv, JANET_NIL) ? 0 : (size_t)env.len + nbase + 1;
+
+    s->arena = malloc((nargv + nenviron) * sizeof(char *) + env_bytes);
+    if (!s->arena)
+        PSPAWN_ERROR("no memory");
+
+    s->argv = (char **)s->arena;
+    for (int32_t i = 0; i < args.len; i++)
+        s->argv[i] = (char *)arg_string(args.items[i]);
+    s->argv[args.len] = NULL;
+
+    if (nenviron) {
+        s->environ = s->argv + nargv;
+
+        char *envitem = (char *)(s->environ + nenviron);
+        int32_t nitems = 0;
+
+        for (int32_t i = 0; i < env.cap; i++) {
+            const JanetKV *kv = env.kvs + i;
+
+            if (janet_checktype(kv->key, JANET_NIL))
+                continue;
+
+            const uint8_t *keys = janet_unwrap_string(kv->key);
+            const uint8_t *vals = janet_unwrap_string(kv->value);
+            size_t klen = janet_string_length(keys);
+            size_t vlen = janet_string_length(vals);
+
+            memcpy(envitem, keys, klen);
+            envitem[klen] = '=';
+            memcpy(envitem + klen + 1, vals, vlen);
+            envitem[klen + vlen + 1] = 0;
+            s->environ[nitems++] = envitem;
+            envitem += klen + vlen + 2;
+        }
+
+        /* Overlay entries come first. */
+        int32_t noverlay = nitems;
+        size_t left = (size_t)((char *)s->arena + (nargv + nenviron) * sizeof(char *) + env_bytes - envitem);
+        for (int32_t i = 0; i < nbase && environ[i]; i++) {
+            char *base = environ[i];
+            int overridden = 0;
+            for (int32_t j = 0; j < noverlay && !overridden; j++)
+                overridden = environ_key_eq(base, s->environ[j]);
+            if (overridden)
+                continue;
+            /* Another thread may have changed environ since it was sized. */
+            size_t len = strlen(base) + 1;
+            if (len > left)
+                break;
+            memcpy(envitem, base, len);
+            s->environ[nitems++] = envitem;
+            envitem += len;
+            left -= len;
+        }
+        s->environ[nitems] = NULL;
+    }
+
+    if (!janet_checktype(argv[2], JANET_NUMBER))
+        PSPAWN_ERROR("close signal must be a number");
+
+    int close_signal_int = (int)janet_unwrap_number(argv[2]);
+    if (close_signal_int == -1)
+        PSPAWN_ERROR("invalid value for :close-signal");
+
+    s->close_signal = close_signal_int;
+
+    Janet jtimeout = opt_get(argv[8], "close-timeout");
+    if (!janet_checktype(jtimeout, JANET_NIL)) {
+        if (!janet_checktype(jtimeout, JANET_NUMBER) || janet_unwrap_number(jtimeout) < 0)
+            PSPAWN_ERRORF(":close-timeout must be a non-negative number, got %v", jtimeout);
+        s->close_timeout = janet_unwrap_number(jtimeout);
+    }
+
+    Janet jkill = opt_get(argv[8], "kill-signal");
+    if (!janet_checktype(jkill, JANET_NIL)) {
+        if (!janet_checkint(jkill) || janet_unwrap_number(jkill) <= 0)
+            PSPAWN_ERRORF("invalid value for :kill-signal, got %v", jkill);
+        s->kill_signal = (int)janet_unwrap_number(jkill);
+    }
+
+    s->shell_exit_codes = janet_truthy(opt_get(argv[8], "shell-exit-codes"));
+    s->detached = janet_truthy(opt_get(argv[8], "detached"));
+
+    if (file_actions_parse(argv[3], &s->actions, &s->nactions, err) != 0)
+        return -1;
+
+    Janet jengine = opt_get(argv[8], "engine");
+
+    Janet vfork_reason = janet_wrap_nil();
+
+    /* posix_spawnp can't always tell an exec failure from a child exiting 127. */
+    if (janet_truthy(opt_get(argv[8], "report-exec-error")))
+        vfork_reason = janet_ckeywordv("report-exec-error");
+
+    /* Only our own child code can exec by fd. */
+    if (s->exe)
+        vfork_reason = janet_ckeywordv("exe");
+
+    if (spawn_spec_sched_init(s, argv[8], &vfork_reason, err) != 0)
+        return -1;
+
+    Janet jcgroup = opt_get(argv[8], "cgroup");
+    if (!janet_checktype(jcgroup, JANET_NIL)) {
+#ifdef __linux__
+        const char *cgroup = file_action_path(jcgroup);
+        if (!cgroup)
+            PSPAWN_ERRORF(":cgroup must be a path, got %v", jcgroup);
+        s->cgroup_fd = open(cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (s->cgroup_fd < 0)
+            PSPAWN_ERRORF("unable to open :cgroup %v", jcgroup);
+        if (janet_checktype(vfork_reason, JANET_NIL))
+            vfork_reason = janet_ckeywordv("cgroup");
+#else
+        PSPAWN_ERROR(":cgroup is only supported on linux");
+#endif
+    }
+
+    Janet jforkserver = opt_get(argv[8], "forkserver");
+    if (!janet_checktype(jforkserver, JANET_NIL)) {
+#ifdef PSPAWN_HAVE_FORKSERVER
+        s->forkserver = (ForkServer *)janet_checkabstract(jforkserver, &forkserver_type);
+        if (!s->forkserver)
+            PSPAWN_ERRORF(":forkserver must be a posix-spawn/forkserver, got %v", jforkserver);
+        if (s->exe)
+            PSPAWN_ERROR("a posix-spawn/exe can't be started by a :forkserver");
+        /* The helper starts children with the vfork engine. */
+        if (janet_checktype(vfork_reason, JANET_NIL))
+            vfork_reason = janet_ckeywordv("forkserver");
+#else
+        PSPAWN_ERROR(":forkserver is only supported on linux");
+#endif
+    }
+
+    int need_vfork = !janet_checktype(vfork_reason, JANET_NIL);
+
+    if (janet_checktype(jengine, JANET_NIL)) {
+        s->engine = (need_vfork || !file_actions_posix_ok(s->actions, s->nactions)) ? ENGINE_VFORK : ENGINE_POSIX;
+    } else if (janet_keyeq(jengine, "posix")) {
+        s->engine = ENGINE_POSIX;
+        if (!file_actions_posix_ok(s->actions, s->nactions))
+            PSPAWN_ERROR("file actions need the vfork engine on this platform");
+        if (need_vfork)
+            PSPAWN_ERRORF("%v needs the vfork engine", vfork_reason);
+    } else if (janet_keyeq(jengine, "vfork")) {
+        s->engine = ENGINE_VFORK;
+    } else {
+        PSPAWN_ERRORF("%v is not a valid :engine", jengine);
+    }
+
+    if (s->engine == ENGINE_POSIX && file_actions_build(s->pfile_actions, s->actions, s->nactions) != 0)
+        PSPAWN_ERROR("unable to add file actions");
+
+    if (!janet_checktype(argv[5], JANET_NUMBER)) {
+        PSPAWN_ERRORF("attr flags must be a number, got %v", argv[5]);
+    }
+
+    /* setflags replaces the whole set, so the sig mask flag must be merged in. */
+    s->attr_flags = (short)janet_unwrap_number(argv[5]) | POSIX_SPAWN_SETSIGMASK;
+
+    Janet jpgroup = opt_get(argv[8], "pgroup");
+    if (!janet_checktype(jpgroup, JANET_NIL)) {
+        if (!janet_checkint(jpgroup) || janet_unwrap_number(jpgroup) < 0)
+            PSPAWN_ERRORF(":pgroup must be a non-negative integer, got %v", jpgroup);
+        s->pgroup = (pid_t)janet_unwrap_number(jpgroup);
+    }
+
+    s->setsid = janet_truthy(opt_get(argv[8], "setsid"));
+    s->close_group = janet_truthy(opt_get(argv[8], "close-group"));
+
+    if (s->setsid && s->pgroup > 0)
+        PSPAWN_ERROR(":setsid can't be used to join a :pgroup");
+
+    /* Signalling a group needs the child to be in one of its own. */
+    if (s->close_group && !s->setsid && s->pgroup < 0)
+        s->pgroup = 0;
+
+    if (s->pgroup >= 0) {
+        s->attr_flags |= POSIX_SPAWN_SETPGROUP;
+        if (posix_spawnattr_setpgroup(s->pattr, s->pgroup) != 0)
+            PSPAWN_ERROR("unable to set spawn attr pgroup");
+    }
+
+    if (s->setsid) {
+#ifdef POSIX_SPAWN_SETSID
+        s->attr_flags |= POSIX_SPAWN_SETSID;
+#else
+        if (s->engine == ENGINE_POSIX && !janet_checktype(jengine, JANET_NIL))
+            PSPAWN_ERROR(":setsid needs the vfork engine on this platform");
+        s->engine = ENGINE_VFORK;
+#endif
+    }
+
+#if defined(POSIX_SPAWN_SETSCHEDULER) && defined(POSIX_SPAWN_SETSCHEDPARAM)
+    if (s->sched_policy >= 0) {
+        /* SETSCHEDULER alone would use a zero priority, keep ours unless one was given. */
+        if (!s->set_sched_param && sched_getparam(0, &s->sched_param) != 0)
+            PSPAWN_ERROR("unable to get sched param");
+        s->attr_flags |= POSIX_SPAWN_SETSCHEDULER;
+        if (posix_spawnattr_setschedpolicy(s->pattr, s->sched_policy) != 0
+                || posix_spawnattr_setschedparam(s->pattr, &s->sched_param) != 0)
+            PSPAWN_ERROR("unable to set spawn attr scheduler");
+    } else if (s->set_sched_param) {
+        s->attr_flags |= POSIX_SPAWN_SETSCHEDPARAM;
+        if (posix_spawnattr_setschedparam(s->pattr, &s->sched_param) != 0)
+            PSPAWN_ERROR("unable to set spawn attr sched param");
+    }
+#endif
+
+    if (posix_spawnattr_setflags(s->pattr, s->attr_flags) != 0) {
+        PSPAWN_ERROR("unable to set spawn attr flags");
+    }
+
+    if (sigemptyset(&sig_dflt_set) != 0 || sigemptyset(&sig_mask_set) != 0) {
+        PSPAWN_ERROR("unable to init signal masks");
+    }
+
+    JanetView sigs;
+
+#define SIGSETARG(S, N) \
+    do { \
+        if (janet_checktype(argv[N], JANET_NIL)) { \
+            sigemptyset(&S); \
+        } else if (janet_keyeq(argv[N], "all")) { \
+            sigfillset(&S); \
+        } else if (janet_indexed_view(argv[N], &sigs.items, &sigs.len)) { \
+            for (int32_t i = 0; i < sigs.len; i++) { \
+                if (!janet_checktype(sigs.items[i], JANET_NUMBER)) \
+                    PSPAWN_ERRORF("signal must be a number, got %v", sigs.items[i]); \
+                sigaddset(&S, janet_unwrap_number(sigs.items[i])); \
+            } \
+        } \
+    } while (0)
+
+    SIGSETARG(sig_dflt_set, 6);
+    SIGSETARG(sig_mask_set, 7);
+#undef SIGSETARG
+
+    s->sig_default = sig_dflt_set;
+    s->sig_mask = sig_mask_set;
+
+    if (posix_spawnattr_setsigdefault(s->pattr, &sig_dflt_set) != 0) {
+        PSPAWN_ERROR("unable to sig default");
+    }
+
+    if (posix_spawnattr_setsigmask(s->pattr, &sig_mask_set) != 0) {
+        PSPAWN_ERROR("unable to set sig mask");
+    }
+
+    return 0;
+
+#undef PSPAWN_ERRORF
+#undef PSPAWN_ERROR
+}
+
+#ifndef NSIG
+#define NSIG 65
+#endif
+
+typedef struct {
+    SpawnSpec *spec;
+    const char *cmd;
+    /* The fd to exec instead of searching for cmd, or -1. */
+    int exe_fd;
+    char **envp;
+    const char *path;
+    long maxfd;
+    sigset_t parent_mask;
+    /* Set by the child when it fails before exec. */
+    volatile int err;
+    /* Without shared memory the error is sent over this CLOEXEC pipe. */
+    int errfd;
+    /* The child was started in its cgroup by clone3. */
+    int in_cgroup;
+    char buf[PATH_MAX];
+} VforkChild;
+
+/*
+   Exec the file open on fd. A script run this way fails with ENOENT, its
+   interpreter can't open the fd once it is closed on exec.
+   Only returns on error, with errno set.
+*/
+static void child_execfd(int fd, char **argv, char **envp) {
+#if defined(__linux__) && defined(SYS_execveat)
+    syscall(SYS_execveat, fd, "", argv, envp, AT_EMPTY_PATH);
+    if (errno != ENOSYS)
+        return;
+#endif
+#ifdef PSPAWN_HAVE_FEXECVE
+    fexecve(fd, argv, envp);
+#else
+    errno = ENOSYS;
+#endif
+}
+
+/*
+   Search path for cmd like execvp, using buf for candidate paths.
+   Only returns on error, with errno set.
+*/
+static void child_execvpe(const char *cmd, const char *path, char **argv, char **envp, char *buf) {
+    if (strchr(cmd, '/')) {
+        execve(cmd, argv, envp);
+        return;
+    }
+
+    if (!path)
+        path = PSPAWN_DEFAULT_PATH;
+
+    size_t cmdlen = strlen(cmd);
+    int seen_eacces = 0;
+
+    for (const char *dir = path;;) {
+        const char *end = strchr(dir, ':');
+        size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+
+        if (dirlen + cmdlen + 2 <= PATH_MAX) {
+            /* An empty path element means the current directory. */
+            size_t n = 0;
+            if (dirlen) {
+                memcpy(buf, dir, dirlen);
+                buf[dirlen] = '/';
+                n = dirlen + 1;
+            }
+            memcpy(buf + n, cmd, cmdlen + 1);
+
+            execve(buf, argv, envp);
+
+            switch (errno) {
+            case EACCES:
+                seen_eacces = 1;
+                break;
+            case ENOENT:
+            case ENOTDIR:
+                break;
+            default:
+                return;
+            }
+        }
+
+        if (!end)
+            break;
+        dir = end + 1;
+    }
+
+    errno = seen_eacces ? EACCES : ENOENT;
+}
+
+#if defined(__linux__) && defined(SYS_close_range)
+/*
+   Close every fd from lowfd up except a and b, either may be -1. Returns
+   -1 with errno set if close_range failed, the caller falls back to close.
+*/
+static int child_close_range(int lowfd, int a, int b) {
+    int keep[2] = {a < b ? a : b, a < b ? b : a};
+    unsigned int lo = (unsigned int)lowfd;
+
+    for (int i = 0; i < 2; i++) {
+        if (keep[i] < lowfd || (unsigned int)keep[i] < lo)
+            continue;
+        if ((unsigned int)keep[i] > lo && syscall(SYS_close_range, lo, (unsigned int)keep[i] - 1, 0) < 0)
+            return -1;
+        lo = (unsigned int)keep[i] + 1;
+    }
+    return syscall(SYS_close_range, lo, ~0U, 0) < 0 ? -1 : 0;
+}
+#endif
+
+/*
+   Apply the spec in the child and exec. When the child shares memory with
+   the parent this must only use async signal safe functions and must not
+   touch state the parent can see.
+*/
+static int vfork_child(void *arg) {
+    VforkChild *c = (VforkChild *)arg;
+    SpawnSpec *s = c->spec;
+
+    /*
+       Signals are blocked, reset any handlers before unblocking them,
+       a handler running in a child sharing memory would corrupt the parent.
+    */
+    struct sigaction dfl;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigemptyset(&dfl.sa_mask);
+
+    for (int sig = 1; sig < NSIG; sig++) {
+        struct sigaction old;
+        int reset = (s->attr_flags & POSIX_SPAWN_SETSIGDEF) && sigismember(&s->sig_default, sig) == 1;
+        if (!reset && sigaction(sig, NULL, &old) == 0)
+            reset = (old.sa_flags & SA_SIGINFO) || (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN);
+        if (reset)
+            sigaction(sig, &dfl, NULL);
+    }
+
+    if (s->cgroup_fd >= 0 && !c->in_cgroup) {
+        /* Writing 0 moves the writer, so the child never execs outside the cgroup. */
+        int fd = openat(s->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd < 0)
+            goto fail;
+        ssize_t n = write(fd, "0", 1);
+        close(fd);
+        if (n != 1)
+            goto fail;
+    }
+
+    if (s->setsid && setsid() < 0)
+        goto fail;
+
+    if (s->pgroup >= 0 && setpgid(0, s->pgroup) < 0)
+        goto fail;
+
+    if (s->sched_policy >= 0) {
+        struct sched_param param = s->sched_param;
+        if (!s->set_sched_param && sched_getparam(0, &param) < 0)
+            goto fail;
+        if (sched_setscheduler(0, s->sched_policy, &param) < 0)
+            goto fail;
+    } else if (s->set_sched_param && sched_setparam(0, &s->sched_param) < 0) {
+        goto fail;
+    }
+
+#ifdef __linux__
+    if (s->set_affinity && sched_setaffinity(0, sizeof(s->affinity), &s->affinity) < 0)
+        goto fail;
+#endif
+
+    if (s->set_nice) {
+        /* nice can return -1 on success. */
+        errno = 0;
+        if (nice(s->nice) == -1 && errno != 0)
+            goto fail;
+    }
+
+    /* Before RESETIDS, raising a hard limit may need the privileges it drops. */
+    for (int32_t i = 0; i < s->nrlimits; i++)
+        if (setrlimit(s->rlimits[i].resource, &s->rlimits[i].limit) < 0)
+            goto fail;
+
+    if (s->attr_flags & POSIX_SPAWN_RESETIDS) {
+        if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
+            goto fail;
+    }
+
+    for (int32_t i = 0; i < s->nactions; i++) {
+        FileAction *a = &s->actions[i];
+        int fd;
+
+        /* Don't report errors over an fd the file actions repurpose. */
+        if ((a->kind == FILE_ACTION_DUP2 && a->newfd == c->errfd) || (a->kind == FILE_ACTION_OPEN && a->fd == c->errfd))
+            c->errfd = -1;
+
+        /* Move the executable out of the way of fds the actions replace. */
+        if (c->exe_fd >= 0 && ((a->kind == FILE_ACTION_DUP2 && a->newfd == c->exe_fd && a->fd != a->newfd) ||
+                ((a->kind == FILE_ACTION_OPEN || a->kind == FILE_ACTION_CLOSE) && a->fd == c->exe_fd))) {
+            int moved = fcntl(c->exe_fd, F_DUPFD_CLOEXEC, 0);
+            if (moved < 0)
+                goto fail;
+            c->exe_fd = moved;
+        }
+
+        switch (a->kind) {
+        case FILE_ACTION_DUP2:
+            if (a->fd == a->newfd) {
+                /* dup2 to itself would keep FD_CLOEXEC, posix_spawn clears it. */
+                int flags = fcntl(a->fd, F_GETFD);
+                if (flags < 0 || fcntl(a->fd, F_SETFD, flags & ~FD_CLOEXEC) < 0)
+                    goto fail;
+            } else if (dup2(a->fd, a->newfd) < 0) {
+                goto fail;
+            }
+            break;
+        case FILE_ACTION_CLOSE:
+            close(a->fd);
+            break;
+        case FILE_ACTION_OPEN:
+            fd = open(a->path, a->flags, a->mode);
+            if (fd < 0)
+                goto fail;
+            if (fd != a->fd) {
+                if (dup2(fd, a->fd) < 0)
+                    goto fail;
+                close(fd);
+            }
+            break;
+        case FILE_ACTION_CHDIR:
+            if (chdir(a->path) < 0)
+                goto fail;
+            break;
+        case FILE_ACTION_CLOSEFROM:
+#if defined(__linux__) && defined(SYS_close_range)
+            /* The executable and the error pipe must survive until the exec. */
+            if (child_close_range(a->fd, c->exe_fd, c->errfd) == 0)
+                break;
+#endif
+            for (long j = a->fd; j < c->maxfd; j++)
+                if (j != c->errfd && j != c->exe_fd)
+                    close((int)j);
+            break;
+        default:
+            goto fail;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, (s->attr_flags & POSIX_SPAWN_SETSIGMASK) ? &s->sig_mask : &c->parent_mask, NULL);
+
+    if (c->exe_fd >= 0)
+        child_execfd(c->exe_fd, s->argv, c->envp);
+    else
+        child_execvpe(c->cmd, c->path, s->argv, c->envp, c->buf);
+
+fail:
+    c->err = errno ? errno : EINVAL;
+    if (c->errfd >= 0) {
+        int err = c->err;
+        ssize_t rc = write(c->errfd, &err, sizeof(err));
+        (void)rc;
+    }
+    _exit(127);
+    return 0;
+}
+
+/*
+   Reap a child that failed before exec. It is never registered with the
+   reaper, which can't drop it while our spawn holds the spawn lock.
+*/
+static void reap_failed_child(pid_t pid) {
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+}
+
+#ifdef PSPAWN_HAVE_CLONE3
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* struct clone_args from linux/sched.h, as of linux 5.7. */
+struct pspawn_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+/*
+   Start the child directly in its cgroup. A raw clone3 child returns on
+   the caller's stack, so it can't share our memory like the clone child,
+   it gets a copy like fork, and the parent still waits for the exec.
+   Returns the pid, or -1 with errno set.
+*/
+static pid_t clone3_cgroup(VforkChild *c) {
+    struct pspawn_clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_VFORK | CLONE_INTO_CGROUP | (c->spec->clone_parent ? CLONE_PARENT : 0);
+    args.exit_signal = SIGCHLD;
+    args.cgroup = (uint64_t)c->spec->cgroup_fd;
+
+    pid_t pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0) {
+        c->in_cgroup = 1;
+        vfork_child(c);
+    }
+    return pid;
+}
+
+#endif
+
+/*
+   Returns 0 on success, otherwise returns an error number. Failures in the
+   child before exec, including exec itself, are reported as errors instead
+   of as a child that exits with status 127.
+*/
+static int vfork_spawn(SpawnSpec *s, const char *cmd, char **envp, pid_t *pid) {
+    VforkChild c;
+    sigset_t all;
+
+    c.spec = s;
+    c.cmd = cmd;
+    c.exe_fd = s->exe ? s->exe->fd : -1;
+    if (s->exe && c.exe_fd < 0)
+        return EBADF;
+    c.envp = envp;
+    c.path = s->path ? s->path : getenv("PATH");
+    c.maxfd = sysconf(_SC_OPEN_MAX);
+    if (c.maxfd < 0)
+        c.maxfd = 1024;
+    c.err = 0;
+    c.errfd = -1;
+    c.in_cgroup = 0;
+
+    int errpipe[2] = {-1, -1};
+#ifdef __linux__
+    int shared = 1;
+#ifdef PSPAWN_HAVE_CLONE3
+    if (s->cgroup_fd >= 0)
+        shared = 0;
+#endif
+#else
+    int shared = 0;
+#endif
+
+    if (!shared) {
+        if (cloexec_pipe(errpipe) < 0)
+            return errno;
+        c.errfd = errpipe[1];
+    }
+
+    /* The child must not run our signal handlers before it resets them. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &c.parent_mask);
+
+#ifdef __linux__
+    /*
+       The parent is suspended until the child execs or exits, so the child
+       stack can live in our frame, the address space is never copied, and
+       the child can report errors by writing to c.
+    */
+    union {
+        char bytes[32768];
+        long double align;
+    } stack;
+
+    *pid = -1;
+#ifdef PSPAWN_HAVE_CLONE3
+    if (!shared) {
+        *pid = clone3_cgroup(&c);
+        /* Kernels before 5.7 can't clone into a cgroup, the child moves itself instead. */
+        if (*pid < 0 && (errno == ENOSYS || errno == E2BIG || errno == EINVAL)) {
+            close(errpipe[0]);
+            close(errpipe[1]);
+            errpipe[0] = errpipe[1] = -1;
+            c.errfd = -1;
+            shared = 1;
+        }
+    }
+#endif
+    if (shared) {
+        int flags = CLONE_VM | CLONE_VFORK | SIGCHLD | (s->clone_parent ? CLONE_PARENT : 0);
+        *pid = clone(vfork_child, stack.bytes + sizeof(stack.bytes), flags, &c);
+    }
+#else
+    /* Without clone, fork keeps the child setup safe at the cost of copying. */
+    *pid = fork();
+    if (*pid == 0)
+        vfork_child(&c);
+#endif
+
+    int err = errno;
+    pthread_sigmask(SIG_SETMASK, &c.parent_mask, NULL);
+
+    if (!shared) {
+        close(errpipe[1]);
+        if (*pid > 0) {
+            int child_err;
+            ssize_t n;
+            do {
+                n = read(errpipe[0], &child_err, sizeof(child_err));
+            } while (n < 0 && errno == EINTR);
+            /* The pipe is closed on a successful exec, so EOF means success. */
+            if (n == sizeof(child_err))
+                c.err = child_err;
+        }
+        close(errpipe[0]);
+    }
+
+    if (*pid < 0)
+        return err;
+
+    if (c.err) {
+        err = c.err;
+        /* Our parent has to reap a CLONE_PARENT child, *pid is left for it. */
+        if (!s->clone_parent) {
+            reap_failed_child(*pid);
+            *pid = -1;
+        }
+        return err;
+    }
+
+    return 0;
+}
+
+#ifdef PSPAWN_HAVE_FORKSERVER
+
+/* Stays under the kernel's SCM_MAX_FD of 253 fds per message. */
+#define FORKSERVER_MAX_FDS 250
+/* How many spawn-many requests are in flight before the replies are read. */
+#define FORKSERVER_BATCH 64
+
+typedef struct {
+    uint32_t size;
+    uint32_t nfds;
+} ForkHeader;
+
+/*
+   The fixed part of a forkserver request, followed by the rlimits, the file
+   actions and then the cmd, PATH, argv, environ and file action path strings.
+   Descriptors are indexes into the fds passed with the header.
+*/
+typedef struct {
+    short attr_flags;
+    sigset_t sig_default;
+    sigset_t sig_mask;
+    pid_t pgroup;
+    int setsid;
+    int set_nice;
+    int nice;
+    int set_affinity;
+    cpu_set_t affinity;
+    int sched_policy;
+    int set_sched_param;
+    struct sched_param sched_param;
+    int cgroup_fd;
+    int has_path;
+    int32_t nrlimits;
+    int32_t nactions;
+    int32_t argc;
+    int32_t envc;
+} ForkRequest;
+
+typedef struct {
+    int32_t err;
+    int32_t pid;
+} ForkReply;
+
+static int file_action_has_path(const FileAction *a) {
+    return a->kind == FILE_ACTION_OPEN || a->kind == FILE_ACTION_CHDIR;
+}
+
+static char *forkserver_put(char *p, const char *str) {
+    size_t n = strlen(str) + 1;
+    memcpy(p, str, n);
+    return p + n;
+}
+
+/* Take the next string of a request, NULL if it runs past the end. */
+static const char *forkserver_next(const char **p, const char *end) {
+    const char *str = *p;
+    const char *nul = memchr(str, 0, (size_t)(end - str));
+    if (!nul)
+        return NULL;
+    *p = nul + 1;
+    return str;
+}
+
+/* Read exactly len bytes, EOF part way is reported as EPIPE. */
+static int forkserver_read(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        if (n == 0)
+            return EPIPE;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Send the iovecs in full, the fds go with the first byte. */
+static int forkserver_sendmsg(int fd, struct iovec *iov, int iovlen, const int *fds, int nfds) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int) * FORKSERVER_MAX_FDS)];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+
+    if (nfds) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    while (msg.msg_iovlen) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (n > 0 && msg.msg_iovlen) {
+            size_t step = (size_t)n < msg.msg_iov->iov_len ? (size_t)n : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            n -= (ssize_t)step;
+            if (msg.msg_iov->iov_len == 0) {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+   A request or reply was cut short, the stream can't be resynced so
+   later spawns fail with EPIPE. The helper exits when it sees EOF.
+*/
+static void forkserver_broken(ForkServer *fs) {
+    if (fs->fd >= 0) {
+        close(fs->fd);
+        fs->fd = -1;
+    }
+}
+
+/* Queue a spawn request, the caller holds fs->lock. */
+static int forkserver_send(ForkServer *fs, SpawnSpec *s, char **envp) {
+    if (fs->fd < 0)
+        return EPIPE;
+
+    const char *path = getenv("PATH");
+    int32_t argc = 0;
+    int32_t envc = 0;
+    while (s->argv[argc])
+        argc++;
+    while (envp[envc])
+        envc++;
+
+    size_t size = sizeof(ForkRequest) + sizeof(SpawnRlimit) * s->nrlimits + sizeof(FileAction) * s->nactions;
+    size += strlen(s->cmd) + 1;
+    if (path)
+        size += strlen(path) + 1;
+    for (int32_t i = 0; i < argc; i++)
+        size += strlen(s->argv[i]) + 1;
+    for (int32_t i = 0; i < envc; i++)
+        size += strlen(envp[i]) + 1;
+    for (int32_t i = 0; i < s->nactions; i++)
+        if (file_action_has_path(&s->actions[i]))
+            size += strlen(s->actions[i].path) + 1;
+    if (size > UINT32_MAX)
+        return E2BIG;
+
+    char *buf = malloc(size);
+    if (!buf)
+        return ENOMEM;
+
+    int fds[FORKSERVER_MAX_FDS];
+    int nfds = 0;
+    int err = 0;
+
+    ForkRequest *req = (ForkRequest *)buf;
+    memset(req, 0, sizeof(*req));
+    req->attr_flags = s->attr_flags;
+    req->sig_default = s->sig_default;
+    req->sig_mask = s->sig_mask;
+    req->pgroup = s->pgroup;
+    req->setsid = s->setsid;
+    req->set_nice = s->set_nice;
+    req->nice = s->nice;
+    req->set_affinity = s->set_affinity;
+    req->affinity = s->affinity;
+    req->sched_policy = s->sched_policy;
+    req->set_sched_param = s->set_sched_param;
+    req->sched_param = s->sched_param;
+    req->cgroup_fd = -1;
+    if (s->cgroup_fd >= 0) {
+        req->cgroup_fd = nfds;
+        fds[nfds++] = s->cgroup_fd;
+    }
+    req->has_path = path != NULL;
+    req->nrlimits = s->nrlimits;
+    req->nactions = s->nactions;
+    req->argc = argc;
+    req->envc = envc;
+
+    SpawnRlimit *rlimits = (SpawnRlimit *)(req + 1);
+    if (s->nrlimits)
+        memcpy(rlimits, s->rlimits, sizeof(SpawnRlimit) * s->nrlimits);
+
+    FileAction *actions = (FileAction *)(rlimits + s->nrlimits);
+    for (int32_t i = 0; i < s->nactions; i++) {
+        actions[i] = s->actions[i];
+        actions[i].path = NULL;
+        if (actions[i].kind == FILE_ACTION_DUP2) {
+            if (nfds == FORKSERVER_MAX_FDS) {
+                err = E2BIG;
+                goto done;
+            }
+            actions[i].fd = nfds;
+            fds[nfds++] = s->actions[i].fd;
+        }
+    }
+
+    char *p = (char *)(actions + s->nactions);
+    p = forkserver_put(p, s->cmd);
+    if (path)
+        p = forkserver_put(p, path);
+    for (int32_t i = 0; i < argc; i++)
+        p = forkserver_put(p, s->argv[i]);
+    for (int32_t i = 0; i < envc; i++)
+        p = forkserver_put(p, envp[i]);
+    for (int32_t i = 0; i < s->nactions; i++)
+        if (file_action_has_path(&s->actions[i]))
+            p = forkserver_put(p, s->actions[i].path);
+
+    ForkHeader hdr;
+    hdr.size = (uint32_t)size;
+    hdr.nfds = (uint32_t)nfds;
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = size;
+
+    err = forkserver_sendmsg(fs->fd, iov, 2, fds, nfds);
+    if (err)
+        forkserver_broken(fs);
+
+done:
+    free(buf);
+    return err;
+}
+
+/* Read the reply to the oldest queued request, the caller holds fs->lock. */
+static int forkserver_recv(ForkServer *fs, pid_t *pid) {
+    ForkReply reply;
+
+    *pid = -1;
+    if (fs->fd < 0)
+        return EPIPE;
+
+    int err = forkserver_read(fs->fd, &reply, sizeof(reply));
+    if (err) {
+        forkserver_broken(fs);
+        return err;
+    }
+
+    if (reply.err) {
+        /* The child failed before exec, it was started as ours so we reap it. */
+        if (reply.pid > 0)
+            reap_failed_child(reply.pid);
+        return reply.err;
+    }
+
+    *pid = reply.pid;
+    return 0;
+}
+
+static int forkserver_spawn(ForkServer *fs, SpawnSpec *s, char **envp, pid_t *pid) {
+    pthread_mutex_lock(&fs->lock);
+    int err = forkserver_send(fs, s, envp);
+    if (!err)
+        err = forkserver_recv(fs, pid);
+    pthread_mutex_unlock(&fs->lock);
+    return err;
+}
+
+/*
+   Rebuild a spec from a request and start the child as a CLONE_PARENT
+   sibling, so the requesting process is the one that waits for it.
+*/
+static int forkserver_handle(const char *buf, size_t size, const int *fds, int nfds, pid_t *pid) {
+    const ForkRequest *req = (const ForkRequest *)buf;
+
+    *pid = -1;
+    if (size < sizeof(ForkRequest) || req->nrlimits < 0 || req->nactions < 0 || req->argc < 1 || req->envc < 0)
+        return EPROTO;
+
+    size_t fixed = sizeof(ForkRequest) + sizeof(SpawnRlimit) * (size_t)req->nrlimits
+        + sizeof(FileAction) * (size_t)req->nactions;
+    if (fixed > size)
+        return EPROTO;
+
+    SpawnSpec s;
+    memset(&s, 0, sizeof(s));
+    s.engine = ENGINE_VFORK;
+    s.attr_flags = req->attr_flags;
+    s.sig_default = req->sig_default;
+    s.sig_mask = req->sig_mask;
+    s.pgroup = req->pgroup;
+    s.setsid = req->setsid;
+    s.set_nice = req->set_nice;
+    s.nice = req->nice;
+    s.set_affinity = req->set_affinity;
+    s.affinity = req->affinity;
+    s.sched_policy = req->sched_policy;
+    s.set_sched_param = req->set_sched_param;
+    s.sched_param = req->sched_param;
+    s.cgroup_fd = -1;
+    if (req->cgroup_fd >= 0) {
+        if (req->cgroup_fd >= nfds)
+            return EPROTO;
+        s.cgroup_fd = fds[req->cgroup_fd];
+    }
+    s.rlimits = (SpawnRlimit *)(req + 1);
+    s.nrlimits = req->nrlimits;
+    s.actions = (FileAction *)(s.rlimits + s.nrlimits);
+    s.nactions = req->nactions;
+    s.clone_parent = 1;
+
+    char **strs = malloc(sizeof(char *) * ((size_t)req->argc + (size_t)req->envc + 2));
+    if (!strs)
+        return ENOMEM;
+
+    int err = EPROTO;
+    const char *p = buf + fixed;
+    const char *end = buf + size;
+    int moved[FORKSERVER_MAX_FDS];
+    for (int i = 0; i < FORKSERVER_MAX_FDS; i++)
+        moved[i] = -1;
+
+    s.cmd = forkserver_next(&p, end);
+    if (!s.cmd)
+        goto done;
+    if (req->has_path && !(s.path = forkserver_next(&p, end)))
+        goto done;
+
+    s.argv = strs;
+    for (int32_t i = 0; i < req->argc; i++)
+        if (!(s.argv[i] = (char *)forkserver_next(&p, end)))
+            goto done;
+    s.argv[req->argc] = NULL;
+
+    char **envp = strs + req->argc + 1;
+    for (int32_t i = 0; i < req->envc; i++)
+        if (!(envp[i] = (char *)forkserver_next(&p, end)))
+            goto done;
+    envp[req->envc] = NULL;
+
+    /*
+       The fds we received are our lowest free ones, an action can replace
+       one before a later action reads it, so they are moved above every fd
+       the actions write to as the parent's fds were.
+    */
+    int floor = 0;
+    for (int32_t i = 0; i < s.nactions; i++) {
+        FileAction *a = &s.actions[i];
+        int target = a->kind == FILE_ACTION_DUP2 ? a->newfd :
+            (a->kind == FILE_ACTION_OPEN || a->kind == FILE_ACTION_CLOSE) ? a->fd : -1;
+        if (target >= floor)
+            floor = target + 1;
+    }
+
+    for (int32_t i = 0; i < s.nactions; i++) {
+        FileAction *a = &s.actions[i];
+        if (a->kind == FILE_ACTION_DUP2) {
+            if (a->fd < 0 || a->fd >= nfds)
+                goto done;
+            if (moved[a->fd] < 0 && fds[a->fd] < floor) {
+                moved[a->fd] = fcntl(fds[a->fd], F_DUPFD_CLOEXEC, floor);
+                if (moved[a->fd] < 0) {
+                    err = errno;
+                    goto done;
+                }
+            }
+            a->fd = moved[a->fd] >= 0 ? moved[a->fd] : fds[a->fd];
+        }
+        a->path = NULL;
+        if (file_action_has_path(a) && !(a->path = forkserver_next(&p, end)))
+            goto done;
+    }
+
+    err = vfork_spawn(&s, s.cmd, envp, pid);
+
+done:
+    for (int i = 0; i < FORKSERVER_MAX_FDS; i++)
+        if (moved[i] >= 0)
+            close(moved[i]);
+    free(strs);
+    return err;
+}
+
+/*
+   Read a request header and the fds sent with it. Returns -1 on a clean
+   EOF between requests, otherwise 0 or an error number.
+*/
+static int forkserver_recv_header(int fd, ForkHeader *hdr, int *fds, int *nfds) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int) * FORKSERVER_MAX_FDS)];
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t n;
+
+    *nfds = 0;
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(*hdr);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return errno;
+    if (n == 0)
+        return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if (*nfds + count > FORKSERVER_MAX_FDS)
+            count = FORKSERVER_MAX_FDS - *nfds;
+        memcpy(fds + *nfds, CMSG_DATA(cmsg), sizeof(int) * count);
+        *nfds += count;
+    }
+
+    int err = 0;
+    if ((size_t)n < sizeof(*hdr))
+        err = forkserver_read(fd, (char *)hdr + n, sizeof(*hdr) - (size_t)n);
+    if (!err && ((msg.msg_flags & MSG_CTRUNC) || hdr->nfds != (uint32_t)*nfds))
+        err = EPROTO;
+    return err;
+}
+
+#endif
+
+/* Record a spawn attempt that began at spawn and finished with err on p. */
+static int spawn_spec_finish(SpawnSpec *s, Process *p, int err, uint64_t start, uint64_t spawn) {
+    if (start) {
+        p->times.start = start;
+        p->times.spawn = spawn;
+        p->times.spawned = stats_now();
+        /* Instrumentation may have been disabled meanwhile, keep the record consistent. */
+        if (!p->times.spawned)
+            p->times.spawned = spawn;
+        stats_spawned(p, err);
+        if (err)
+            memset(&p->times, 0, sizeof(p->times));
+    }
+
+    if (err != 0) {
+        p->pid = -1;
+        return err;
+    }
+
+    p->exited = 0;
+    if (reaper_enabled)
+        p->reap_gen = reaper_register(p->pid);
+    if (s->setsid || s->pgroup == 0)
+        p->pgid = p->pid;
+    else if (s->pgroup > 0)
+        p->pgid = s->pgroup;
+    p->close_group = s->close_group;
+    p->close_timeout = s->close_timeout;
+    p->kill_signal = s->kill_signal;
+    p->shell_exit_codes = s->shell_exit_codes;
+    /* Without memory for the hand off the child stays with its handle. */
+    if (s->detached)
+        process_release(p);
+    return 0;
+}
+
+/*
+   Start a child from a prepared spec, start is the stats_now time the spawn
+   call was made at. Returns 0 on success, otherwise returns the posix_spawnp
+   error number.
+*/
+static int spawn_spec_spawn(SpawnSpec *s, Process *p, uint64_t start) {
+    process_init(p, s->close_signal);
+
+    char **envp = s->environ ? s->environ : environ;
+
+    int err;
+    const char *cmd = s->cmd;
+    char resolved[PATH_MAX];
+
+    /* The forkserver searches its own copy of our PATH. */
+    if (path_cache_enabled && !s->forkserver && !strchr(cmd, '/') &&
+            path_resolve(cmd, getenv("PATH"), resolved) == 0 && resolved[0] == '/')
+        cmd = resolved;
+
+    uint64_t spawn = start ? stats_now() : 0;
+    int locked = reaper_spawn_begin();
+
+#ifdef PSPAWN_HAVE_FORKSERVER
+    if (s->forkserver)
+        err = forkserver_spawn(s->forkserver, s, envp, &p->pid);
+    else
+#endif
+    if (s->engine == ENGINE_VFORK)
+        err = vfork_spawn(s, cmd, envp, &p->pid);
+    else if (cmd == resolved)
+        err = posix_spawn(&p->pid, cmd, s->pfile_actions, s->pattr, s->argv, envp);
+    else
+        err = posix_spawnp(&p->pid, cmd, s->pfile_actions, s->pattr, s->argv, envp);
+
+    err = spawn_spec_finish(s, p, err, start, spawn);
+    reaper_spawn_end(locked);
+    return err;
+}
+
+#ifdef PSPAWN_HAVE_FORKSERVER
+/*
+   Start n children through the forkserver, queueing up to FORKSERVER_BATCH
+   requests before reading their replies. Started children are pushed onto
+   procs, returns the first error.
+*/
+static int forkserver_spawn_many(SpawnSpec *s, int32_t n, JanetArray *procs, uint64_t start) {
+    ForkServer *fs = s->forkserver;
+    char **envp = s->environ ? s->environ : environ;
+
+    int err = 0;
 
-            if (janet_checktype(kv->key, JANET_NIL))
+    for (int32_t i = 0; i < n && !err; i += FORKSERVER_BATCH) {
+        Process *batch[FORKSERVER_BATCH];
+        int rcs[FORKSERVER_BATCH];
+        int32_t k = (n - i < FORKSERVER_BATCH) ? n - i : FORKSERVER_BATCH;
+        int32_t sent = 0;
+
+        for (int32_t j = 0; j < k; j++) {
+            batch[j] = (Process *)janet_abstract(&process_type, sizeof(Process));
+            process_init(batch[j], s->close_signal);
+        }
+
+        uint64_t spawn = start ? stats_now() : 0;
+        /* Taken after the allocations, a collection under it could wait for the reaper. */
+        int locked = reaper_spawn_begin();
+
+        pthread_mutex_lock(&fs->lock);
+        while (sent < k && !(err = forkserver_send(fs, s, envp)))
+            sent++;
+        for (int32_t j = 0; j < sent; j++)
+            rcs[j] = forkserver_recv(fs, &batch[j]->pid);
+        pthread_mutex_unlock(&fs->lock);
+
+        for (int32_t j = 0; j < sent; j++)
+            rcs[j] = spawn_spec_finish(s, batch[j], rcs[j], start, spawn);
+        reaper_spawn_end(locked);
+
+        for (int32_t j = 0; j < sent; j++) {
+            int rc = rcs[j];
+            if (rc == 0)
+                janet_array_push(procs, janet_wrap_abstract(batch[j]));
+            else if (!err)
+                err = rc;
+        }
+    }
+
+    return err;
+}
+#endif
+
+/* Stop children started by a failed batch before raising the error. */
+static void close_started(JanetArray *procs) {
+    for (int32_t j = 0; j < procs->count; j++) {
+        Process *started = (Process *)janet_unwrap_abstract(procs->data[j]);
+        if (process_close_signal(started, started->close_signal) == 0)
+            process_wait(started, NULL, 0);
+    }
+}
+
+static Janet primitive_pspawn(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 9);
+    uint64_t start = stats_now();
+
+    SpawnSpec spec;
+    SpawnError err;
+
+    Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+    process_init(p, SIGTERM);
+
+    if (spawn_spec_init(&spec, argv, &err) != 0) {
+        spawn_spec_deinit(&spec);
+        spawn_error_panic(&err);
+    }
+
+    int rc = spawn_spec_spawn(&spec, p, start);
+    spawn_spec_deinit(&spec);
+
+    if (rc != 0)
+        janet_panicf("spawn failed: %s", strerror(rc));
+
+    return janet_wrap_abstract(p);
+}
+
+static Janet primitive_pspawn_many(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 10);
+    uint64_t start = stats_now();
+
+    int32_t n = janet_getnat(argv, 0);
+
+    SpawnSpec spec;
+    SpawnError err;
+
+    if (spawn_spec_init(&spec, argv + 1, &err) != 0) {
+        spawn_spec_deinit(&spec);
+        spawn_error_panic(&err);
+    }
+
+    JanetArray *procs = janet_array(n);
+
+#ifdef PSPAWN_HAVE_FORKSERVER
+    if (spec.forkserver) {
+        int rc = forkserver_spawn_many(&spec, n, procs, start);
+        spawn_spec_deinit(&spec);
+        if (rc != 0) {
+            close_started(procs);
+            janet_panicf("spawn failed: %s", strerror(rc));
+        }
+        return janet_wrap_array(procs);
+    }
+#endif
+
+    for (int32_t i = 0; i < n; i++) {
+        Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+        int rc = spawn_spec_spawn(&spec, p, start);
+        if (rc != 0) {
+            spawn_spec_deinit(&spec);
+            /* Don't hand back a partial batch, take down what we started. */
+            close_started(procs);
+            janet_panicf("spawn failed: %s", strerror(rc));
+        }
+        janet_array_push(procs, janet_wrap_abstract(p));
+    }
+
+    spawn_spec_deinit(&spec);
+    return janet_wrap_array(procs);
+}
+
+static Janet dup2_action(int fd, int newfd) {
+    Janet *t = janet_tuple_begin(3);
+    t[0] = janet_ckeywordv("dup2");
+    t[1] = janet_wrap_integer(fd);
+    t[2] = janet_wrap_integer(newfd);
+    return janet_wrap_tuple(janet_tuple_end(t));
+}
+
+/*
+   Spawn each stage with stdout connected to the stdin of the next stage.
+   Takes the stages followed by the primitive spawn arguments from
+   close-signal onwards, each stage runs (stage 0).
+*/
+static Janet primitive_pspawn_pipeline(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 8);
+    uint64_t start = stats_now();
+
+    JanetView stages = janet_getindexed(argv, 0);
+    if (stages.len < 1)
+        janet_panic("pipeline needs at least one stage");
+
+    Janet jstdin = opt_get(argv[7], "stdin");
+    Janet jstdout = opt_get(argv[7], "stdout");
+    int stdin_fd = janet_checktype(jstdin, JANET_NIL) ? -1 : file_action_fd(jstdin);
+    int stdout_fd = janet_checktype(jstdout, JANET_NIL) ? -1 : file_action_fd(jstdout);
+    if (stdin_fd == -2 || stdout_fd == -2)
+        janet_panic(":stdin and :stdout must be a file, stream or fd");
+
+    JanetView shared_actions = {NULL, 0};
+    if (!janet_checktype(argv[2], JANET_NIL) && !janet_indexed_view(argv[2], &shared_actions.items, &shared_actions.len))
+        janet_panic("file action elements must be an indexed type");
+
+    int32_t npipes = stages.len - 1;
+    int *pipes = calloc(2 * (size_t)npipes + 1, sizeof(int));
+    if (!pipes)
+        janet_panic("no memory");
+
+    for (int32_t i = 0; i < npipes; i++) {
+        if (cloexec_pipe(pipes + 2 * i) < 0) {
+            int err = errno;
+            for (int32_t j = 0; j < 2 * i; j++)
+                close(pipes[j]);
+            free(pipes);
+            janet_panicf("unable to allocate pipe - %s", strerror(err));
+        }
+    }
+
+    JanetArray *procs = janet_array(stages.len);
+    SpawnError err;
+    int rc = 0;
+
+    err.msg = NULL;
+
+    for (int32_t i = 0; i < stages.len && !err.msg && rc == 0; i++) {
+        SpawnSpec spec;
+        Janet sargv[9];
+        JanetView stage;
+
+        if (!janet_indexed_view(stages.items[i], &stage.items, &stage.len) || stage.len < 1) {
+            err.want_errorf = 1;
+            err.msg = "pipeline stage must be a non empty indexed type, got %v";
+            err.ctx = stages.items[i];
+            break;
+        }
+
+        /* The pipe ends are CLOEXEC, so only the dup2'd copies reach the child. */
+        JanetArray *actions = janet_array(shared_actions.len + 2);
+        if (i > 0)
+            janet_array_push(actions, dup2_action(pipes[2 * (i - 1)], 0));
+        else if (stdin_fd >= 0)
+            janet_array_push(actions, dup2_action(stdin_fd, 0));
+        if (i < npipes)
+            janet_array_push(actions, dup2_action(pipes[2 * i + 1], 1));
+        else if (stdout_fd >= 0)
+            janet_array_push(actions, dup2_action(stdout_fd, 1));
+        for (int32_t j = 0; j < shared_actions.len; j++)
+            janet_array_push(actions, shared_actions.items[j]);
+
+        sargv[0] = stage.items[0];
+        sargv[1] = stages.items[i];
+        sargv[2] = argv[1];
+        sargv[3] = janet_wrap_array(actions);
+        for (int32_t j = 4; j < 9; j++)
+            sargv[j] = argv[j - 1];
+
+        if (spawn_spec_init(&spec, sargv, &err) == 0) {
+            /* Like a shell job, later stages join the group of the first. */
+            if (spec.pgroup == 0 && procs->count > 0) {
+                spec.pgroup = ((Process *)janet_unwrap_abstract(procs->data[0]))->pgid;
+                if (posix_spawnattr_setpgroup(spec.pattr, spec.pgroup) != 0) {
+                    err.want_errorf = 0;
+                    err.msg = "unable to set spawn attr pgroup";
+                }
+            }
+            if (!err.msg) {
+                Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+                rc = spawn_spec_spawn(&spec, p, start);
+                if (rc == 0)
+                    janet_array_push(procs, janet_wrap_abstract(p));
+            }
+        }
+        spawn_spec_deinit(&spec);
+    }
+
+    for (int32_t j = 0; j < 2 * npipes; j++)
+        close(pipes[j]);
+    free(pipes);
+
+    if (err.msg || rc != 0) {
+        close_started(procs);
+        if (err.msg)
+            spawn_error_panic(&err);
+        janet_panicf("spawn failed: %s", strerror(rc));
+    }
+
+    return janet_wrap_array(procs);
+}
+
+/* One output of a captured child, drained into buf up to max bytes. */
+typedef struct {
+    int fd;
+    JanetBuffer *buf;
+    size_t max;
+    int truncated;
+} CaptureStream;
+
+/* Data fed to a captured child's stdin through a non-blocking pipe. */
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t len;
+    size_t off;
+} CaptureInput;
+
+#define PSPAWN_CAPTURE_CHUNK 65536
+
+/*
+   Write as much of the input as the pipe takes without blocking.
+   Returns 1 when done or the child closed its stdin, 0 if there is
+   more to write, and -1 with errno set on error.
+*/
+static int capture_feed(CaptureInput *in) {
+    while (in->off < in->len) {
+        /*
+           A plain write, vmsplice would leave the pipe referencing the
+           pages of a janet buffer that can be modified or freed while
+           the child still has them unread.
+        */
+        ssize_t n = write(in->fd, in->data + in->off, in->len - in->off);
+
+        if (n < 0) {
+            if (errno == EINTR)
                 continue;
+            if (errno == EAGAIN)
+                return 0;
+            if (errno == EPIPE)
+                return 1;
+            return -1;
+        }
 
-            if (!janet_checktype(kv->key, JANET_STRING))
-                PSPAWN_ERROR("environ key is not a string");
+        in->off += (size_t)n;
+    }
 
-            if (!janet_checktype(kv->value, JANET_STRING))
-                PSPAWN_ERROR("environ value is not a string");
+    return 1;
+}
 
-            const uint8_t *keys = janet_unwrap_string(kv->key);
-            const uint8_t *vals = janet_unwrap_string(kv->value);
-            size_t klen = janet_string_length(keys);
-            size_t vlen = janet_string_length(vals);
+/* A child that closes stdin early must not kill us with SIGPIPE. */
+typedef struct {
+    sigset_t old_mask;
+    int was_pending;
+} SigpipeBlock;
 
-            if (strlen((char *)keys) != klen)
-                PSPAWN_ERROR("environ keys cannot have embedded nulls");
+static void sigpipe_block(SigpipeBlock *b) {
+    sigset_t sigpipe, pending;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &b->old_mask);
+    sigemptyset(&pending);
+    sigpending(&pending);
+    b->was_pending = sigismember(&pending, SIGPIPE) == 1;
+}
 
-            if (strlen((char *)vals) != vlen)
-                PSPAWN_ERROR("environ values cannot have embedded nulls");
+/* Take a SIGPIPE our writes raised before restoring the signal mask. */
+static void sigpipe_unblock(SigpipeBlock *b) {
+    sigset_t sigpipe, pending;
+    int sig;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigemptyset(&pending);
+    sigpending(&pending);
+    if (!b->was_pending && sigismember(&pending, SIGPIPE) == 1)
+        sigwait(&sigpipe, &sig);
+    pthread_sigmask(SIG_SETMASK, &b->old_mask, NULL);
+}
 
-            char *envitem = malloc(klen + vlen + 2);
-            if (!envitem)
-                PSPAWN_ERROR("no memory");
-            memcpy(envitem, keys, klen);
-            envitem[klen] = '=';
-            memcpy(envitem + klen + 1, vals, vlen);
-            envitem[klen + vlen + 1] = 0;
-            penviron[nenviron++] = envitem;
+#ifdef JANET_EV
+
+typedef struct {
+    Janet data;
+    size_t off;
+} AsyncFeed;
+
+static void feed_callback(JanetFiber *fiber, JanetAsyncEvent event) {
+    AsyncFeed *state = (AsyncFeed *)fiber->ev_state;
+    JanetStream *stream = fiber->ev_stream;
+
+    switch (event) {
+    case JANET_ASYNC_EVENT_MARK:
+        janet_mark(state->data);
+        break;
+    case JANET_ASYNC_EVENT_CLOSE:
+        janet_cancel(fiber, janet_cstringv("stream closed"));
+        janet_async_end(fiber);
+        break;
+    case JANET_ASYNC_EVENT_INIT:
+    case JANET_ASYNC_EVENT_WRITE:
+    case JANET_ASYNC_EVENT_ERR:
+    case JANET_ASYNC_EVENT_HUP: {
+        /* A buffer may have been resized since the last write, view it again. */
+        JanetByteView view;
+        janet_bytes_view(state->data, &view.bytes, &view.len);
+        CaptureInput in;
+        in.fd = (int)stream->handle;
+        in.data = view.bytes;
+        in.len = (size_t)view.len;
+        in.off = state->off < in.len ? state->off : in.len;
+
+        SigpipeBlock sigpipe;
+        sigpipe_block(&sigpipe);
+        int rc = capture_feed(&in);
+        int err = errno;
+        sigpipe_unblock(&sigpipe);
+
+        state->off = in.off;
+        if (rc == 0)
+            break;
+        if (rc < 0)
+            janet_cancel(fiber, janet_wrap_string(janet_formatc("unable to write to child - %s", strerror(err))));
+        else
+            janet_schedule(fiber, janet_wrap_number((double)in.off));
+        janet_async_end(fiber);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*
+   Write data to a non-blocking stream a child reads from, suspending the
+   fiber while the pipe is full. Resumes with the number of bytes written,
+   fewer than the data when the child closed its end.
+*/
+static Janet pspawn_feed(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    JanetStream *stream = (JanetStream *)janet_getabstract(argv, 0, &janet_stream_type);
+    JanetByteView view;
+
+    if (stream->flags & JANET_STREAM_CLOSED)
+        janet_panic("stream is closed");
+    if (!janet_bytes_view(argv[1], &view.bytes, &view.len))
+        janet_panicf("expected a string or buffer, got %v", argv[1]);
+
+    AsyncFeed *state = (AsyncFeed *)janet_malloc(sizeof(AsyncFeed));
+    if (!state)
+        janet_panic("no memory");
+    state->data = argv[1];
+    state->off = 0;
+    janet_async_start(stream, JANET_ASYNC_LISTEN_WRITE, feed_callback, state);
+}
+
+#endif
+
+/*
+   Read all the streams until end of file, in whatever order the child
+   writes them, so a child blocked on a full pipe can't deadlock us.
+   Output past a stream's max is read and dropped. When in is not NULL its
+   data is written to the child between reads. The fds are closed.
+   Returns 0 on success, -1 with errno set.
+*/
+static int capture_drain(CaptureStream *streams, int n, CaptureInput *in) {
+    char scratch[4096];
+    struct pollfd pfds[3];
+    int nopen = 0;
+
+    for (int i = 0; i < n; i++)
+        if (streams[i].fd >= 0)
+            nopen++;
+
+    while (nopen || (in && in->fd >= 0)) {
+        int npfds = 0;
+        for (int i = 0; i < n; i++) {
+            if (streams[i].fd < 0)
+                continue;
+            pfds[npfds].fd = streams[i].fd;
+            pfds[npfds].events = POLLIN;
+            pfds[npfds].revents = 0;
+            npfds++;
+        }
+
+        if (in && in->fd >= 0) {
+            pfds[npfds].fd = in->fd;
+            pfds[npfds].events = POLLOUT;
+            pfds[npfds].revents = 0;
+            npfds++;
+        }
+
+        if (poll(pfds, npfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+
+        if (in && in->fd >= 0 && pfds[npfds - 1].revents) {
+            int done = capture_feed(in);
+            if (done < 0)
+                goto fail;
+            if (done) {
+                /* EOF lets the child finish reading. */
+                close(in->fd);
+                in->fd = -1;
+            }
+        }
+
+        for (int i = 0, k = 0; i < n; i++) {
+            CaptureStream *cs = &streams[i];
+            if (cs->fd < 0)
+                continue;
+            if (!pfds[k++].revents)
+                continue;
+
+            ssize_t nread;
+            size_t room = cs->max - (size_t)cs->buf->count;
+            if (room) {
+                size_t want = room < PSPAWN_CAPTURE_CHUNK ? room : PSPAWN_CAPTURE_CHUNK;
+                janet_buffer_extra(cs->buf, (int32_t)want);
+                nread = read(cs->fd, cs->buf->data + cs->buf->count, want);
+                if (nread > 0)
+                    cs->buf->count += (int32_t)nread;
+            } else {
+                nread = read(cs->fd, scratch, sizeof(scratch));
+                if (nread > 0)
+                    cs->truncated = 1;
+            }
+
+            if (nread < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                goto fail;
+            }
+
+            if (nread == 0) {
+                close(cs->fd);
+                cs->fd = -1;
+                nopen--;
+            }
         }
     }
 
-    if (!janet_checktype(argv[5], JANET_NUMBER)) {
-        PSPAWN_ERRORF("attr flags must be a number, got %v", argv[5]);
+    return 0;
+
+fail:;
+    int err = errno;
+    for (int i = 0; i < n; i++) {
+        if (streams[i].fd >= 0) {
+            close(streams[i].fd);
+            streams[i].fd = -1;
+        }
     }
-    if (posix_spawnattr_setflags(pattr, janet_unwrap_number(argv[5])) != 0) {
-        PSPAWN_ERROR("unable to set spawn attr flags");
+    if (in && in->fd >= 0) {
+        close(in->fd);
+        in->fd = -1;
+    }
+    errno = err;
+    return -1;
+}
+
+/*
+   Run a child with stdout and stderr connected to pipes that are drained
+   into buffers, and :stdin-data fed to its stdin, then wait for it and
+   return a result struct. Takes the same arguments as spawn.
+*/
+static Janet primitive_pspawn_capture(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 9);
+    uint64_t start = stats_now();
+
+    size_t max = SIZE_MAX;
+    Janet jmax = opt_get(argv[8], "max-output");
+    if (!janet_checktype(jmax, JANET_NIL)) {
+        if (!janet_checkint(jmax) || janet_unwrap_number(jmax) < 0)
+            janet_panicf(":max-output must be a non-negative integer, got %v", jmax);
+        max = (size_t)janet_unwrap_number(jmax);
     }
+    /* Janet buffers are indexed by int32_t. */
+    if (max > INT32_MAX)
+        max = INT32_MAX;
 
-    if (sigemptyset(&sig_dflt_set) != 0 || sigemptyset(&sig_mask_set) != 0) {
-        PSPAWN_ERROR("unable to init signal masks");
+    int32_t hint = 0;
+    Janet jhint = opt_get(argv[8], "size-hint");
+    if (!janet_checktype(jhint, JANET_NIL)) {
+        if (!janet_checkint(jhint) || janet_unwrap_number(jhint) < 0)
+            janet_panicf(":size-hint must be a non-negative integer, got %v", jhint);
+        hint = (int32_t)janet_unwrap_number(jhint);
+        if ((size_t)hint > max)
+            hint = (int32_t)max;
     }
 
-    JanetView sigs;
+    JanetByteView stdin_data = {NULL, 0};
+    Janet jstdin = opt_get(argv[8], "stdin-data");
+    int feed = !janet_checktype(jstdin, JANET_NIL);
+    if (feed && !janet_bytes_view(jstdin, &stdin_data.bytes, &stdin_data.len))
+        janet_panicf(":stdin-data must be a string or buffer, got %v", jstdin);
 
-#define SIGSETARG(S, N) \
-    do { \
-        if (janet_checktype(argv[N], JANET_NIL)) { \
-            sigemptyset(&S); \
-        } else if (janet_keyeq(argv[N], "all")) { \
-            sigfillset(&S); \
-        } else if (janet_indexed_view(argv[N], &sigs.items, &sigs.len)) { \
-            for (int32_t i = 0; i < sigs.len; i++) { \
-                if (!janet_checktype(sigs.items[i], JANET_NUMBER)) \
-                    PSPAWN_ERRORF("signal must be a number, got %v", sigs.items[i]); \
-                sigaddset(&S, janet_unwrap_number(sigs.items[i])); \
-            } \
-        } \
-    } while (0)
+    JanetView user_actions = {NULL, 0};
+    if (!janet_checktype(argv[3], JANET_NIL) && !janet_indexed_view(argv[3], &user_actions.items, &user_actions.len))
+        janet_panic("file action elements must be an indexed type");
 
-    SIGSETARG(sig_dflt_set, 6);
-    SIGSETARG(sig_mask_set, 7);
-#undef SIGSETARG
+    /* stdout, stderr and stdin pipes, -1 when not used. */
+    int fds[6] = {-1, -1, -1, -1, -1, -1};
+
+    for (int i = 0; i < 3; i++) {
+        if (i == 2 && !feed)
+            continue;
+        if (cloexec_pipe(fds + 2 * i) < 0) {
+            int err = errno;
+            for (int j = 0; j < 6; j++)
+                if (fds[j] >= 0)
+                    close(fds[j]);
+            janet_panicf("unable to allocate pipe - %s", strerror(err));
+        }
+    }
+
+    /* Like pipeline, the user's file actions run after ours. */
+    JanetArray *actions = janet_array(user_actions.len + 3);
+    janet_array_push(actions, dup2_action(fds[1], 1));
+    janet_array_push(actions, dup2_action(fds[3], 2));
+    if (feed)
+        janet_array_push(actions, dup2_action(fds[4], 0));
+    for (int32_t i = 0; i < user_actions.len; i++)
+        janet_array_push(actions, user_actions.items[i]);
+
+    Janet sargv[9];
+    memcpy(sargv, argv, sizeof(sargv));
+    sargv[3] = janet_wrap_array(actions);
+
+    SpawnSpec spec;
+    SpawnError err;
+    Process p;
+    int rc = -1;
+
+    if (spawn_spec_init(&spec, sargv, &err) == 0)
+        rc = spawn_spec_spawn(&spec, &p, start);
+    spawn_spec_deinit(&spec);
+
+    /* Close the child's ends. */
+    for (int i = 0; i < 3; i++) {
+        int child_end = (i == 2) ? 4 : 2 * i + 1;
+        if (fds[child_end] >= 0)
+            close(fds[child_end]);
+    }
+
+    if (rc == 0 && feed && fcntl(fds[5], F_SETFL, O_NONBLOCK) < 0) {
+        int fcntl_err = errno;
+        if (process_close_signal(&p, p.close_signal) == 0)
+            process_wait(&p, NULL, 0);
+        rc = fcntl_err;
+        err.msg = NULL;
+    }
+
+    if (rc != 0) {
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[2] >= 0)
+            close(fds[2]);
+        if (fds[5] >= 0)
+            close(fds[5]);
+        if (err.msg)
+            spawn_error_panic(&err);
+        janet_panicf("spawn failed: %s", strerror(rc));
+    }
+
+    CaptureStream streams[2];
+    for (int i = 0; i < 2; i++) {
+        streams[i].fd = fds[2 * i];
+        streams[i].buf = janet_buffer(hint);
+        streams[i].max = max;
+        streams[i].truncated = 0;
+    }
+
+    CaptureInput in;
+    in.fd = fds[5];
+    in.data = stdin_data.bytes;
+    in.len = (size_t)stdin_data.len;
+    in.off = 0;
+
+    SigpipeBlock sigpipe;
+    if (feed)
+        sigpipe_block(&sigpipe);
+
+    int drain_rc = capture_drain(streams, 2, feed ? &in : NULL);
+    int drain_err = errno;
+
+    if (feed)
+        sigpipe_unblock(&sigpipe);
+
+    if (drain_rc < 0) {
+        if (process_close_signal(&p, p.close_signal) == 0)
+            process_wait(&p, NULL, 0);
+        janet_panicf("unable to communicate with child - %s", strerror(drain_err));
+    }
+
+    int exit_code;
+    if (process_wait(&p, &exit_code, 0) != 0)
+        janet_panicf("error waiting for process - %s", strerror(errno));
+
+    int truncated = streams[0].truncated || streams[1].truncated;
+    JanetKV *st = janet_struct_begin(truncated ? 4 : 3);
+    janet_struct_put(st, janet_ckeywordv("exit-code"), janet_wrap_integer(exit_code));
+    janet_struct_put(st, janet_ckeywordv("stdout"), janet_wrap_buffer(streams[0].buf));
+    janet_struct_put(st, janet_ckeywordv("stderr"), janet_wrap_buffer(streams[1].buf));
+    if (truncated)
+        janet_struct_put(st, janet_ckeywordv("truncated"), janet_wrap_true());
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/*
+   A compiled spawn spec that can be reused for many spawns. The spec borrows
+   argument strings and file descriptors from the values it was compiled from,
+   so those are kept alive with the template.
+*/
+typedef struct {
+    SpawnSpec spec;
+    Janet cmd;
+    Janet args;
+    Janet file_actions;
+    Janet forkserver;
+} Template;
+
+static int template_gc(void *ptr, size_t s) {
+    (void)s;
+    Template *t = (Template *)ptr;
+    spawn_spec_deinit(&t->spec);
+    return 0;
+}
+
+static int template_gcmark(void *ptr, size_t s) {
+    (void)s;
+    Template *t = (Template *)ptr;
+    janet_mark(t->cmd);
+    janet_mark(t->args);
+    janet_mark(t->file_actions);
+    janet_mark(t->forkserver);
+    return 0;
+}
+
+static const JanetAbstractType template_type = {
+    "posix-spawn/template", template_gc, template_gcmark, JANET_ATEND_GCMARK
+};
+
+static Janet primitive_pspawn_template(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 9);
+
+    SpawnError err;
+
+    Template *t = (Template *)janet_abstract(&template_type, sizeof(Template));
+    t->cmd = argv[0];
+    t->args = argv[1];
+    t->file_actions = argv[3];
+    t->forkserver = opt_get(argv[8], "forkserver");
+
+    if (spawn_spec_init(&t->spec, argv, &err) != 0) {
+        spawn_spec_deinit(&t->spec);
+        spawn_error_panic(&err);
+    }
+
+    return janet_wrap_abstract(t);
+}
+
+/*
+   Spawn from a template with optional extra args and file actions,
+   the extra file actions run after the template file actions.
+*/
+static Janet primitive_pspawn_from_template(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    uint64_t start = stats_now();
+
+    Template *t = (Template *)janet_getabstract(argv, 0, &template_type);
+
+    Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+    process_init(p, SIGTERM);
+
+    if (janet_checktype(argv[1], JANET_NIL) && janet_checktype(argv[2], JANET_NIL)) {
+        int rc = spawn_spec_spawn(&t->spec, p, start);
+        if (rc != 0)
+            janet_panicf("spawn failed: %s", strerror(rc));
+        return janet_wrap_abstract(p);
+    }
+
+    /* Share the template attrs and environ, but build a per call argv and action list. */
+    SpawnSpec call = t->spec;
+    SpawnError err;
+    JanetView extra_args = {NULL, 0};
+    FileAction *actions = NULL;
+    int32_t nactions = 0;
+    int32_t base_argc = 0;
+    char **extra_argv = NULL;
+    posix_spawn_file_actions_t *owned_file_actions = NULL;
+
+    err.msg = NULL;
+    err.want_errorf = 0;
+    err.ctx = janet_wrap_nil();
+
+#define PSPAWN_ERROR(M) do { err.msg = M; goto done; } while (0);
+#define PSPAWN_ERRORF(M, V) do { err.want_errorf = 1; err.msg = M; err.ctx = V; goto done; } while (0);
+
+    if (!janet_checktype(argv[1], JANET_NIL)) {
+        if (!janet_indexed_view(argv[1], &extra_args.items, &extra_args.len))
+            PSPAWN_ERRORF("extra args must be an indexed type, got %v", argv[1]);
+
+        while (t->spec.argv[base_argc])
+            base_argc++;
+
+        extra_argv = calloc(base_argc + extra_args.len + 1, sizeof(char *));
+        if (!extra_argv)
+            PSPAWN_ERROR("no memory");
+
+        memcpy(extra_argv, t->spec.argv, base_argc * sizeof(char *));
+        for (int32_t i = 0; i < extra_args.len; i++) {
+            extra_argv[base_argc + i] = (char *)arg_string(extra_args.items[i]);
+            if (!extra_argv[base_argc + i])
+                PSPAWN_ERRORF("%v is not a valid argument", extra_args.items[i]);
+        }
+        call.argv = extra_argv;
+    }
+
+    if (!janet_checktype(argv[2], JANET_NIL)) {
+        if (t->spec.nactions) {
+            actions = malloc(t->spec.nactions * sizeof(FileAction));
+            if (!actions)
+                PSPAWN_ERROR("no memory");
+            memcpy(actions, t->spec.actions, t->spec.nactions * sizeof(FileAction));
+            nactions = t->spec.nactions;
+        }
+
+        if (file_actions_parse(argv[2], &actions, &nactions, &err) != 0)
+            goto done;
+
+        call.actions = actions;
+        call.nactions = nactions;
 
-    if (posix_spawnattr_setflags(pattr, POSIX_SPAWN_SETSIGMASK) != 0) {
-        PSPAWN_ERROR("unable to setflags");
-    }
+        if (call.engine == ENGINE_POSIX) {
+            if (!file_actions_posix_ok(actions, nactions))
+                PSPAWN_ERROR("file actions need the vfork engine on this platform");
 
-    if (posix_spawnattr_setsigdefault(pattr, &sig_dflt_set) != 0) {
-        PSPAWN_ERROR("unable to sig default");
-    }
+            if (posix_spawn_file_actions_init(&call.file_actions) != 0)
+                PSPAWN_ERROR("unable to init file actions set");
+            owned_file_actions = &call.file_actions;
+            call.pfile_actions = owned_file_actions;
 
-    if (posix_spawnattr_setsigmask(pattr, &sig_mask_set) != 0) {
-        PSPAWN_ERROR("unable to set sig mask");
+            if (file_actions_build(call.pfile_actions, actions, nactions) != 0)
+                PSPAWN_ERROR("unable to add file actions");
+        }
     }
 
-    if (posix_spawnp(&p->pid, pcmd, pfile_actions, pattr, pargv, penviron) != 0) {
-        p->pid = -1;
-        PSPAWN_ERRORF("spawn failed: %v", janet_cstringv(strerror(errno)));
-    }
-    p->exited = 0;
+    int rc = spawn_spec_spawn(&call, p, start);
+    if (rc != 0)
+        PSPAWN_ERRORF("spawn failed: %v", janet_cstringv(strerror(rc)));
 
 done:
 
-    if (penviron) {
-        for (int32_t i = nenviron-1; i >= 0; i--) {
-            free(penviron[i]);
-        }
-        free(penviron);
-    }
+    if (owned_file_actions)
+        posix_spawn_file_actions_destroy(owned_file_actions);
 
-    if (pargv) {
-        free(pargv);
-    }
+    free(actions);
+    free(extra_argv);
 
-    if (pfile_actions) {
-        posix_spawn_file_actions_destroy(pfile_actions);
-    }
+    if (err.msg)
+        spawn_error_panic(&err);
+
+    return janet_wrap_abstract(p);
+
+#undef PSPAWN_ERRORF
+#undef PSPAWN_ERROR
+}
 
-    if (pattr) {
-        posix_spawnattr_destroy(pattr);
+static Janet process_state_keyword(int event) {
+    switch (event) {
+    case PSTATE_STOPPED:
+        return janet_ckeywordv("stopped");
+    case PSTATE_CONTINUED:
+        return janet_ckeywordv("continued");
+    default:
+        return janet_ckeywordv("exited");
     }
+}
+
+#ifdef JANET_EV
+
+typedef struct {
+    Process *p;
+    int drain;
+    int states; /* Also resume on stops and continues. */
+    ReapWaiter *waiter; /* Registered with the reaper, or NULL. */
+    SigchldWaiter *sigchld; /* Woken on each SIGCHLD, or NULL. */
+    int closing; /* The stream is being closed, ignore its CLOSE event. */
+} AsyncWait;
+
+static void process_wait_callback(JanetFiber *fiber, JanetAsyncEvent event) {
+    AsyncWait *state = (AsyncWait *)fiber->ev_state;
+    JanetStream *stream = fiber->ev_stream;
+    int exit_code;
+    int state_event;
+
+    switch (event) {
+    case JANET_ASYNC_EVENT_MARK:
+        janet_mark(janet_wrap_abstract(state->p));
+        break;
+    case JANET_ASYNC_EVENT_DEINIT:
+        if (state->waiter) {
+            reaper_waiter_remove(state->waiter);
+            state->waiter = NULL;
+        }
+        if (state->sigchld) {
+            sigchld_waiter_remove(state->sigchld);
+            state->sigchld = NULL;
+        }
+        /* Runs on completion and on ev/cancel alike, the stream is ours to close. */
+        if (!state->closing) {
+            state->closing = 1;
+            janet_stream_close(stream);
+        }
+        break;
+    case JANET_ASYNC_EVENT_CLOSE:
+        if (state->closing)
+            break;
+        state->closing = 1;
+        janet_cancel(fiber, janet_cstringv("stream closed"));
+        janet_async_end(fiber);
+        break;
+    case JANET_ASYNC_EVENT_ERR:
+        janet_cancel(fiber, janet_cstringv("error waiting for process"));
+        janet_async_end(fiber);
+        break;
+    case JANET_ASYNC_EVENT_INIT:
+    case JANET_ASYNC_EVENT_READ:
+    case JANET_ASYNC_EVENT_HUP:
+        if (state->drain) {
+            char buf[64];
+            while (read(stream->handle, buf, sizeof(buf)) > 0);
+        }
 
-    if (error_msg) {
-        if (want_errorf) {
-            janet_panicf(error_msg, error_ctx);
+        if (state->states) {
+            if (process_wait_state(state->p, &state_event, WNOHANG) != 0) {
+                janet_cancel(fiber, janet_wrap_string(janet_formatc("error waiting for process - %s", strerror(errno))));
+            } else if (state_event == PSTATE_NONE) {
+                break;
+            } else {
+                janet_schedule(fiber, process_state_keyword(state_event));
+            }
+        } else if (process_wait(state->p, &exit_code, WNOHANG) != 0) {
+            janet_cancel(fiber, janet_wrap_string(janet_formatc("error waiting for process - %s", strerror(errno))));
+        } else if (exit_code == -1) {
+            break;
         } else {
-            janet_panic(error_msg);
+            janet_schedule(fiber, janet_wrap_integer(exit_code));
         }
+        janet_async_end(fiber);
+        break;
+    default:
+        break;
     }
+}
 
-    return janet_wrap_abstract(p);
+/*
+   Suspend the current fiber until p exits, the fiber is resumed
+   with the exit code. With states the fiber is also resumed on a
+   stop or continue, with the event keyword instead. Does not return.
+*/
+JANET_NO_RETURN static void process_wait_async(Process *p, int states) {
+    AsyncWait *state;
+    ReapWaiter *waiter = NULL;
+    SigchldWaiter *sigchld = NULL;
+    int fd;
+    int drain = 0;
 
-#undef PSPAWN_ERRORF
-#undef PSPAWN_ERROR
+    if (reaper_enabled) {
+        /* A pidfd can fire before the reaper thread has the status, so it tells us instead. */
+        fd = reaper_waiter_add(p, states, &waiter);
+        if (fd < 0)
+            janet_panicf("unable to wait for process - %s", strerror(errno));
+        goto listen;
+    }
+
+#ifdef PSPAWN_HAVE_PIDFD
+    /* A pidfd only becomes readable on exit. */
+    fd = states ? -1 : (int)syscall(SYS_pidfd_open, p->pid, 0);
+    if (fd < 0) {
+        /*
+           Kernels before 5.3 have no pidfd_open. A shared handle's pid may
+           already be reaped by another handle, the first check finds that
+           exit in the shared state.
+        */
+        if (!states && errno != ENOSYS && !(errno == ESRCH && p->shared))
+            janet_panicf("unable to open pidfd - %s", strerror(errno));
+#endif
+        fd = sigchld_waiter_add(&sigchld);
+        if (fd < 0)
+            janet_panicf("unable to wait for SIGCHLD - %s", strerror(errno));
+        drain = 1;
+#ifdef PSPAWN_HAVE_PIDFD
+    }
+#endif
+
+listen:;
+    JanetStream *stream = janet_stream(fd, JANET_STREAM_READABLE, NULL);
+    state = (AsyncWait *)janet_malloc(sizeof(AsyncWait));
+    if (!state) {
+        if (waiter)
+            reaper_waiter_remove(waiter);
+        if (sigchld)
+            sigchld_waiter_remove(sigchld);
+        janet_stream_close(stream);
+        janet_panic("no memory");
+    }
+    state->p = p;
+    state->drain = drain;
+    state->states = states;
+    state->waiter = waiter;
+    state->sigchld = sigchld;
+    state->closing = 0;
+    janet_async_start(stream, JANET_ASYNC_LISTEN_READ, process_wait_callback, state);
 }
 
+#endif
+
 static Janet pspawn_wait(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
     Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
 
     int exit_code;
 
+    if (p->released)
+        janet_panic("process was released");
+
+#ifdef JANET_EV
+    if (!p->exited && p->pid != -1) {
+        /* Another handle may have reaped it, then its pid can't be watched. */
+        if (process_shared_get(p))
+            process_set_exited(p);
+        else
+            process_wait_async(p, 0);
+    }
+#endif
+
     if (process_wait(p, &exit_code, 0) != 0)
         janet_panicf("error waiting for process - %s", strerror(errno));
 
     return janet_wrap_integer(exit_code);
 }
 
+static Janet pspawn_wait_state(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
+
+    int event;
+
+    if (p->released)
+        janet_panic("process was released");
+
+#ifdef JANET_EV
+    if (!p->exited && p->pid != -1) {
+        /* Another handle may have reaped it, then its pid can't be watched. */
+        if (process_shared_get(p))
+            process_set_exited(p);
+        else
+            process_wait_async(p, 1);
+    }
+#endif
+
+    if (process_wait_state(p, &event, 0) != 0)
+        janet_panicf("error waiting for process - %s", strerror(errno));
+
+    return process_state_keyword(event);
+}
+
+static Janet pspawn_release(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
+
+    if (process_release(p) != 0)
+        janet_panicf("unable to release process - %s", strerror(errno));
+
+    return janet_wrap_nil();
+}
+
 static Janet pspawn_signal(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
@@ -451,50 +5026,103 @@ static Janet pspawn_signal(int32_t argc, Janet *argv) {
 }
 
 static Janet pspawn_close(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 2);
     Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
+    int sig = janet_optinteger(argv, argc, 1, -1);
 
-    if (p->exited)
+    if (p->exited && !p->close_group)
         return janet_wrap_nil();
 
     int rc;
 
-    rc = process_signal(p, p->close_signal);
+    rc = process_close_signal(p, sig == -1 ? p->close_signal : sig);
     if (rc < 0)
         janet_panicf("unable to signal process - %s", strerror(errno));
 
+    /* An explicit signal means the caller is doing its own escalation. */
+    if (sig == -1 && p->close_timeout >= 0 && !p->exited) {
+        rc = process_wait_timeout(p, p->close_timeout);
+        if (rc < 0)
+            janet_panicf("unable to wait for process - %s", strerror(errno));
+        if (rc == 0 && process_close_signal(p, p->kill_signal) < 0)
+            janet_panicf("unable to signal process - %s", strerror(errno));
+    }
+
     rc = process_wait(p, NULL, 0);
     if (rc < 0)
         janet_panicf("unable to wait for process - %s", strerror(errno));
 
+    /* The group has been told to close, gc doesn't need to do it again. */
+    p->close_group = 0;
+
     return janet_wrap_nil();
 }
 
-static Janet pspawn_pipe(int32_t argc, Janet *argv) {
-    (void)argv;
-    janet_fixarity(argc, 0);
+static Janet pspawn_close_signal(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    Process *p = (Process *)janet_getabstract(argv, 0, &process_type);
+    int sig = janet_optinteger(argv, argc, 1, p->close_signal);
+
+    if (process_close_signal(p, sig) < 0)
+        janet_panicf("unable to signal process - %s", strerror(errno));
+
+    return janet_wrap_nil();
+}
+
+#ifdef JANET_EV
+
+static Janet pspawn_stream_pipe(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+
+    int blocking[2] = {0, 0};
+
+    if (argc > 0 && !janet_checktype(argv[0], JANET_NIL)) {
+        if (janet_keyeq(argv[0], "read"))
+            blocking[0] = 1;
+        else if (janet_keyeq(argv[0], "write"))
+            blocking[1] = 1;
+        else
+            janet_panicf("expected :read or :write, got %v", argv[0]);
+    }
 
     int fds[2];
-#ifdef __APPLE__
-    if (pipe(fds) < 0)
+    if (cloexec_pipe(fds) < 0)
         janet_panicf("unable to allocate pipe - %s", strerror(errno));
 
-    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0) {
-        close(fds[0]);
-        close(fds[1]);
-        janet_panicf("unable to set pipe FD_CLOEXEC - %s", strerror(errno));
+    for (int i = 0; i < 2; i++) {
+        if (!blocking[i] && fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            janet_panicf("unable to set pipe O_NONBLOCK - %s", strerror(errno));
+        }
     }
 
-    if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0){
-        close(fds[0]);
-        close(fds[1]);
-        janet_panicf("unable to set pipe FD_CLOEXEC - %s", strerror(errno));
-    }
-#else
-    if (pipe2(fds, O_CLOEXEC) < 0)
-        janet_panicf("unable to allocate pipe - %s", strerror(errno));
+    Janet *t = janet_tuple_begin(2);
+    t[0] = janet_wrap_abstract(janet_stream(fds[0], JANET_STREAM_READABLE, NULL));
+    t[1] = janet_wrap_abstract(janet_stream(fds[1], JANET_STREAM_WRITABLE, NULL));
+    return janet_wrap_tuple(janet_tuple_end(t));
+}
+
 #endif
 
+static Janet pspawn_start_reaper(int32_t argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+
+    if (reaper_start() < 0)
+        janet_panicf("unable to start reaper - %s", strerror(errno));
+
+    return janet_wrap_nil();
+}
+
+static Janet pspawn_pipe(int32_t argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+
+    int fds[2];
+    if (cloexec_pipe(fds) < 0)
+        janet_panicf("unable to allocate pipe - %s", strerror(errno));
+
     FILE *p1 = fdopen(fds[0], "rb");
     FILE *p2 = fdopen(fds[1], "wb");
     if (!p1 || !p2) {
@@ -516,12 +5144,427 @@ static Janet pspawn_pipe(int32_t argc, Janet *argv) {
     return janet_wrap_tuple(janet_tuple_end(t));
 }
 
+/*
+   Data copying between fds without passing through janet buffers.
+
+   On linux we try, in order, splice (either end is a pipe), copy_file_range
+   (file to file) and sendfile (file to anything), falling back to a plain
+   read/write loop. The first method that works is remembered for the rest
+   of the copy so a failing syscall is only tried once.
+*/
+
+enum {
+    COPY_SPLICE,
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+#define PSPAWN_COPY_CHUNK (1 << 16)
+
+/* Wait for fd to become ready after EAGAIN on a non blocking stream. */
+static int copy_poll(int fd, short events) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    int rc;
+    do {
+        rc = poll(&pfd, 1, -1);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -1 : 0;
+}
+
+static ssize_t copy_read_write(int in, int out, size_t n) {
+    char buf[PSPAWN_COPY_CHUNK];
+    if (n > sizeof(buf))
+        n = sizeof(buf);
+
+    ssize_t nread;
+    do {
+        nread = read(in, buf, n);
+        if (nread < 0 && errno == EAGAIN) {
+            if (copy_poll(in, POLLIN) < 0)
+                return -1;
+            errno = EINTR;
+        }
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread <= 0)
+        return nread;
+
+    ssize_t off = 0;
+    while (off < nread) {
+        ssize_t w = write(out, buf + off, nread - off);
+        if (w < 0) {
+            if (errno == EAGAIN) {
+                if (copy_poll(out, POLLOUT) < 0)
+                    return -1;
+            } else if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        off += w;
+    }
+
+    return nread;
+}
+
+/*
+   Copy at most n bytes from in to out, returns the number of bytes copied,
+   0 at end of file, or -1 with errno set.
+*/
+static ssize_t copy_chunk(int in, int out, size_t n, int *method) {
+    for (;;) {
+        ssize_t rc;
+
+        switch (*method) {
+#ifdef __linux__
+        case COPY_SPLICE:
+            rc = splice(in, NULL, out, NULL, n, SPLICE_F_MOVE);
+            break;
+#ifdef PSPAWN_HAVE_COPY_FILE_RANGE
+        case COPY_FILE_RANGE:
+            rc = syscall(SYS_copy_file_range, in, NULL, out, NULL, n, 0);
+            break;
+#else
+        case COPY_FILE_RANGE:
+            rc = -1;
+            errno = ENOSYS;
+            break;
+#endif
+        case COPY_SENDFILE:
+            rc = sendfile(out, in, NULL, n);
+            break;
+#endif
+        default:
+            *method = COPY_READ_WRITE;
+            return copy_read_write(in, out, n);
+        }
+
+        if (rc >= 0)
+            return rc;
+
+        switch (errno) {
+        case EINTR:
+            break;
+        case EAGAIN:
+            if (copy_poll(in, POLLIN) < 0 || copy_poll(out, POLLOUT) < 0)
+                return -1;
+            break;
+        case EINVAL:
+        case ENOSYS:
+        case EXDEV:
+        case EBADF:
+        case ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+        case EOPNOTSUPP:
+#endif
+            /* This pair of fds can't use this method, try the next one. */
+            (*method)++;
+            break;
+        default:
+            return -1;
+        }
+    }
+}
+
+static int copy_getfd(const Janet *argv, int32_t n) {
+    int fd = file_action_fd(argv[n]);
+    if (fd == -2)
+        janet_panicf("bad slot #%d, expected file, stream or fd, got %v", n, argv[n]);
+    if (fd == -1)
+        janet_panicf("bad slot #%d, file or stream is closed", n);
+
+    /* Anything buffered in a janet file must reach the fd before we write past it. */
+    if (janet_checkfile(argv[n])) {
+        FILE *f = janet_unwrapfile(argv[n], NULL);
+        fflush(f);
+    }
+
+    return fd;
+}
+
+static Janet pspawn_splice(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    int in = copy_getfd(argv, 0);
+    int out = copy_getfd(argv, 1);
+    size_t n = argc > 2 ? janet_getsize(argv, 2) : PSPAWN_COPY_CHUNK;
+
+    int method = COPY_SPLICE;
+    ssize_t rc = copy_chunk(in, out, n, &method);
+    if (rc < 0)
+        janet_panicf("unable to copy data - %s", strerror(errno));
+
+    return janet_wrap_number((double)rc);
+}
+
+static Janet pspawn_copy_all(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    int in = copy_getfd(argv, 0);
+    int out = copy_getfd(argv, 1);
+
+    int method = COPY_SPLICE;
+    /* Large chunks let splice and copy_file_range do the whole copy in a few calls. */
+    size_t n = (size_t)1 << 30;
+    double total = 0;
+
+    for (;;) {
+        ssize_t rc = copy_chunk(in, out, method == COPY_READ_WRITE ? PSPAWN_COPY_CHUNK : n, &method);
+        if (rc < 0)
+            janet_panicf("unable to copy data - %s", strerror(errno));
+        if (rc == 0)
+            break;
+        total += (double)rc;
+    }
+
+    return janet_wrap_number(total);
+}
+
+static Janet pspawn_tee(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    int in = copy_getfd(argv, 0);
+    int out = copy_getfd(argv, 1);
+    size_t n = argc > 2 ? janet_getsize(argv, 2) : PSPAWN_COPY_CHUNK;
+
+#ifdef __linux__
+    ssize_t rc;
+    for (;;) {
+        rc = tee(in, out, n, 0);
+        if (rc >= 0)
+            break;
+        if (errno == EAGAIN) {
+            if (copy_poll(in, POLLIN) < 0 || copy_poll(out, POLLOUT) < 0)
+                janet_panicf("unable to tee data - %s", strerror(errno));
+        } else if (errno != EINTR) {
+            janet_panicf("unable to tee data - %s", strerror(errno));
+        }
+    }
+
+    return janet_wrap_number((double)rc);
+#else
+    (void)in;
+    (void)out;
+    (void)n;
+    janet_panic("tee is only supported on linux");
+#endif
+}
+
+
+static Janet pspawn_instrument(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    stats_enabled = janet_truthy(argv[0]);
+    return janet_wrap_nil();
+}
+
+static Janet pspawn_path_cache(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    path_cache_enabled = janet_truthy(argv[0]);
+    if (!path_cache_enabled)
+        path_cache_clear();
+    return janet_wrap_nil();
+}
+
+static Janet pspawn_which(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *cmd = janet_getcstring(argv, 0);
+    char buf[PATH_MAX];
+
+    if (path_resolve(cmd, getenv("PATH"), buf) != 0)
+        return janet_wrap_nil();
+
+    return janet_cstringv(buf);
+}
+
+static Janet pspawn_stats(int32_t argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+
+    pthread_mutex_lock(&stats_lock);
+    JanetKV *st = janet_struct_begin(8);
+    janet_struct_put(st, janet_ckeywordv("enabled"), janet_wrap_boolean(stats_enabled));
+    janet_struct_put(st, janet_ckeywordv("spawns"), janet_wrap_number((double)stats.spawns));
+    janet_struct_put(st, janet_ckeywordv("failures"), janet_wrap_number((double)stats.failures));
+    janet_struct_put(st, janet_ckeywordv("live"), janet_wrap_number((double)stats.live));
+    janet_struct_put(st, janet_ckeywordv("marshal-ns-total"), janet_wrap_number((double)stats.marshal_ns));
+    janet_struct_put(st, janet_ckeywordv("spawn-ns-total"), janet_wrap_number((double)stats.spawn_ns));
+    janet_struct_put(st, janet_ckeywordv("spawn-ns-avg"),
+                     janet_wrap_number(stats.spawns ? (double)stats.spawn_ns / (double)stats.spawns : 0));
+    janet_struct_put(st, janet_ckeywordv("spawn-ns-max"), janet_wrap_number((double)stats.spawn_ns_max));
+    pthread_mutex_unlock(&stats_lock);
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static Janet pspawn_stats_reset(int32_t argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+
+    pthread_mutex_lock(&stats_lock);
+    /* live is a gauge of running children, not a counter. */
+    int64_t live = stats.live;
+    memset(&stats, 0, sizeof(stats));
+    stats.live = live;
+    pthread_mutex_unlock(&stats_lock);
+
+    return janet_wrap_nil();
+}
+
+/*
+   Start a forkserver helper from args, the helper is given its end of
+   the socket as fd 3 and should call forkserver-main on it.
+*/
+static Janet pspawn_forkserver_start(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+#ifndef PSPAWN_HAVE_FORKSERVER
+    (void)argv;
+    janet_panic("forkserver is only supported on linux");
+#else
+    uint64_t start = stats_now();
+    JanetView args = janet_getindexed(argv, 0);
+    if (args.len < 1)
+        janet_panic("forkserver needs a command to run");
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        janet_panicf("unable to create forkserver socket: %s", strerror(errno));
+
+    ForkServer *fs = (ForkServer *)janet_abstract(&forkserver_type, sizeof(ForkServer));
+    fs->fd = -1;
+    fs->helper = janet_wrap_nil();
+    pthread_mutex_init(&fs->lock, NULL);
+
+    Janet *closefrom = janet_tuple_begin(2);
+    closefrom[0] = janet_ckeywordv("close-from");
+    closefrom[1] = janet_wrap_integer(4);
+
+    Janet actions[2];
+    actions[0] = dup2_action(sv[1], 3);
+    actions[1] = janet_wrap_tuple(janet_tuple_end(closefrom));
+
+    Janet spawn_argv[9];
+    spawn_argv[0] = args.items[0];
+    spawn_argv[1] = janet_wrap_tuple(janet_tuple_n(args.items, args.len));
+    spawn_argv[2] = janet_wrap_integer(SIGTERM);
+    spawn_argv[3] = janet_wrap_tuple(janet_tuple_n(actions, 2));
+    spawn_argv[4] = janet_wrap_nil();
+    spawn_argv[5] = janet_wrap_integer(POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    spawn_argv[6] = janet_ckeywordv("all");
+    spawn_argv[7] = janet_wrap_nil();
+    spawn_argv[8] = janet_wrap_nil();
+
+    SpawnSpec spec;
+    SpawnError err;
+
+    Process *p = (Process *)janet_abstract(&process_type, sizeof(Process));
+    process_init(p, SIGTERM);
+
+    if (spawn_spec_init(&spec, spawn_argv, &err) != 0) {
+        spawn_spec_deinit(&spec);
+        close(sv[0]);
+        close(sv[1]);
+        spawn_error_panic(&err);
+    }
+
+    int rc = spawn_spec_spawn(&spec, p, start);
+    spawn_spec_deinit(&spec);
+    close(sv[1]);
+
+    if (rc != 0) {
+        close(sv[0]);
+        janet_panicf("spawn failed: %s", strerror(rc));
+    }
+
+    fs->fd = sv[0];
+    fs->helper = janet_wrap_abstract(p);
+    return janet_wrap_abstract(fs);
+#endif
+}
+
+/* The helper side, serve spawn requests from fd until the other end closes it. */
+static Janet pspawn_forkserver_main(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+#ifndef PSPAWN_HAVE_FORKSERVER
+    (void)argv;
+    janet_panic("forkserver is only supported on linux");
+#else
+    int fd = janet_getinteger(argv, 0);
+
+    /* Children must not hold the socket open after we exit. */
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+        janet_panicf("invalid forkserver fd: %s", strerror(errno));
+
+    for (;;) {
+        ForkHeader hdr;
+        int fds[FORKSERVER_MAX_FDS];
+        int nfds;
+
+        int rc = forkserver_recv_header(fd, &hdr, fds, &nfds);
+        if (rc < 0)
+            break;
+
+        char *buf = NULL;
+        if (!rc && !(buf = malloc(hdr.size ? hdr.size : 1)))
+            rc = ENOMEM;
+        if (!rc)
+            rc = forkserver_read(fd, buf, hdr.size);
+
+        ForkReply reply;
+        pid_t pid = -1;
+        if (!rc)
+            reply.err = forkserver_handle(buf, hdr.size, fds, nfds, &pid);
+
+        free(buf);
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+
+        if (rc)
+            janet_panicf("forkserver request failed: %s", strerror(rc));
+
+        reply.pid = pid;
+        struct iovec iov;
+        iov.iov_base = &reply;
+        iov.iov_len = sizeof(reply);
+        if (forkserver_sendmsg(fd, &iov, 1, NULL, 0) != 0)
+            break;
+    }
+
+    close(fd);
+    return janet_wrap_nil();
+#endif
+}
+
 static const JanetReg cfuns[] = {
     {"spawn", primitive_pspawn, "(posix-spawn/spawn & args)\n\n"},
+    {"spawn-many", primitive_pspawn_many, "(posix-spawn/spawn-many n & args)\n\n"},
+    {"capture", primitive_pspawn_capture, "(posix-spawn/capture & args)\n\nRun a child and capture its stdout and stderr."},
+#ifdef JANET_EV
+    {"feed", pspawn_feed, "(posix-spawn/feed stream data)\n\nWrite data to a stream a child reads from."},
+#endif
+    {"pipeline", primitive_pspawn_pipeline, "(posix-spawn/pipeline stages & args)\n\nSpawn stages connected stdout to stdin with pipes."},
+    {"template", primitive_pspawn_template, "(posix-spawn/template & args)\n\n"},
+    {"spawn-template", primitive_pspawn_from_template, "(posix-spawn/spawn-template t extra-args extra-file-actions)\n\n"},
     {"signal", pspawn_signal, "(posix-spawn/signal p sig)\n\n"},
-    {"close", pspawn_close, "(posix-spawn/close p)\n\n"},
+    {"close", pspawn_close, "(posix-spawn/close p &opt sig)\n\n"},
+    {"close-signal", pspawn_close_signal, "(posix-spawn/close-signal p &opt sig)\n\n"},
     {"wait", pspawn_wait, "(posix-spawn/wait p)\n\n"},
+    {"release", pspawn_release, "(posix-spawn/release p)\n\nGive up p without killing it, it is reaped in the background."},
+    {"wait-state", pspawn_wait_state, "(posix-spawn/wait-state p)\n\nWait for the next stop, continue or exit of p."},
     {"pipe", pspawn_pipe, "(posix-spawn/pipe)\n\n"},
+    {"start-reaper", pspawn_start_reaper, "(posix-spawn/start-reaper)\n\n"},
+    {"forkserver-start", pspawn_forkserver_start, "(posix-spawn/forkserver-start args)\n\nStart a forkserver helper running args."},
+    {"forkserver-main", pspawn_forkserver_main, "(posix-spawn/forkserver-main fd)\n\nServe forkserver requests on fd, run by the helper."},
+    {"instrument", pspawn_instrument, "(posix-spawn/instrument enabled)\n\n"},
+    {"stats", pspawn_stats, "(posix-spawn/stats)\n\n"},
+    {"path-cache", pspawn_path_cache, "(posix-spawn/path-cache enabled)\n\nEnable or disable caching of PATH lookups."},
+    {"open-exe", pspawn_open_exe, "(posix-spawn/open-exe path)\n\nOpen an executable to spawn by fd."},
+    {"which", pspawn_which, "(posix-spawn/which cmd)\n\nResolve cmd against PATH, nil if it is not found."},
+    {"stats-reset", pspawn_stats_reset, "(posix-spawn/stats-reset)\n\n"},
+    {"splice", pspawn_splice, "(posix-spawn/splice from to &opt n)\n\n"},
+    {"copy-all", pspawn_copy_all, "(posix-spawn/copy-all from to)\n\n"},
+    {"tee", pspawn_tee, "(posix-spawn/tee from to &opt n)\n\n"},
+#ifdef JANET_EV
+    {"stream-pipe", pspawn_stream_pipe, "(posix-spawn/stream-pipe &opt blocking-end)\n\n"},
+#endif
     {NULL, NULL, NULL}
 };
 
@@ -531,5 +5574,12 @@ JANET_MODULE_ENTRY(JanetTable *env) {
     DEF_CONSTANT_INT(POSIX_SPAWN_SETSIGMASK);
     DEF_CONSTANT_INT(POSIX_SPAWN_SETSIGDEF);
     DEF_CONSTANT_INT(POSIX_SPAWN_RESETIDS);
+    DEF_CONSTANT_INT(O_RDONLY);
+    DEF_CONSTANT_INT(O_WRONLY);
+    DEF_CONSTANT_INT(O_RDWR);
+    DEF_CONSTANT_INT(O_CREAT);
+    DEF_CONSTANT_INT(O_EXCL);
+    DEF_CONSTANT_INT(O_TRUNC);
+    DEF_CONSTANT_INT(O_APPEND);
 #undef DEF_CONSTANT_INT
 }